@@ -0,0 +1,192 @@
+/*
+#  Copyright (c) 2011, 2012, 2013, 2014, 2015 by Lawrence Livermore National Security, LLC. LLNL-CODE-645430
+#  Produced at the Lawrence Livermore National Laboratory.
+#  Written by Marty McFadden, Kathleen Shoga and Barry Rountree (mcfadden1|shoga1|rountree@llnl.gov).
+#  All rights reserved.
+#
+#  This file is part of msr-safe.
+#
+#  msr-safe is free software: you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation, either
+#  version 3 of the License, or (at your option) any
+#  later version.
+#
+#  msr-safe is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along
+#  with msr-safe. If not, see <http://www.gnu.org/licenses/>.
+#
+#  This material is based upon work supported by the U.S. Department
+#  of Energy's Lawrence Livermore National Laboratory. Office of
+#  Science, under Award number DE-AC52-07NA27344.
+*/
+/*
+ * Compare X86_IOC_MSR_BATCH, which copies the op array in and out on
+ * every call, against running an mmap()ed region in place.
+ *
+ * usage: msr_batch_bench [msr [seconds_per_point]]
+ *
+ * Every op reads the same whitelisted MSR (default 0x10, the TSC); ops
+ * are spread round-robin over the online CPUs.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../msr.h"
+
+enum {
+    MIN_OPS = 8,
+    MAX_OPS = 64 * 1024,
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill_ops(struct msr_batch_op *ops, uint32_t numops, uint32_t msr, int num_cpu)
+{
+    uint32_t i;
+    for (i = 0; i < numops; ++i)
+    {
+        memset(&ops[i], 0, sizeof(ops[i]));
+        ops[i].cpu = i % num_cpu;
+        ops[i].isrdmsr = 1;
+        ops[i].msr = msr;
+    }
+}
+
+/* Returns mean nanoseconds per call, or a negative value on error. */
+static double time_copy(int fd, struct msr_batch_op *ops, uint32_t numops, double seconds)
+{
+    struct msr_batch_array arr = {numops, ops};
+    double start = now();
+    double elapsed = 0.0;
+    long calls = 0;
+
+    do
+    {
+        if (ioctl(fd, X86_IOC_MSR_BATCH, &arr))
+        {
+            perror("X86_IOC_MSR_BATCH");
+            return -1.0;
+        }
+        ++calls;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    return elapsed * 1e9 / calls;
+}
+
+static double time_region(int fd, uint32_t region, uint32_t numops, double seconds)
+{
+    struct msr_batch_region_run run = {region, numops};
+    double start = now();
+    double elapsed = 0.0;
+    long calls = 0;
+
+    do
+    {
+        if (ioctl(fd, X86_IOC_MSR_BATCH_REGION_RUN, &run))
+        {
+            perror("X86_IOC_MSR_BATCH_REGION_RUN");
+            return -1.0;
+        }
+        ++calls;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    return elapsed * 1e9 / calls;
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    int fd = -1;
+    uint32_t msr = argc > 1 ? strtoul(argv[1], NULL, 0) : 0x10;
+    double seconds = argc > 2 ? strtod(argv[2], NULL) : 0.5;
+    int num_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t numops;
+    struct msr_batch_op *ops = NULL;
+    struct msr_batch_op *shared = MAP_FAILED;
+    struct msr_batch_region region = {MAX_OPS, 0, 0};
+
+    fd = open("/dev/cpu/msr_batch", O_RDONLY);
+    if (fd == -1)
+    {
+        err = errno ? errno : -1;
+        perror("Could not open \"/dev/cpu/msr_batch\"");
+        goto exit;
+    }
+
+    ops = (struct msr_batch_op *)malloc(MAX_OPS * sizeof(*ops));
+    if (!ops)
+    {
+        err = errno ? errno : -1;
+        perror("Unable to allocate op array");
+        goto exit;
+    }
+
+    if (ioctl(fd, X86_IOC_MSR_BATCH_REGION_CREATE, &region))
+    {
+        err = errno ? errno : -1;
+        perror("X86_IOC_MSR_BATCH_REGION_CREATE");
+        goto exit;
+    }
+
+    shared = (struct msr_batch_op *)mmap(NULL, MAX_OPS * sizeof(*shared),
+                                         PROT_READ | PROT_WRITE, MAP_SHARED,
+                                         fd, region.offset);
+    if (shared == MAP_FAILED)
+    {
+        err = errno ? errno : -1;
+        perror("mmap of batch region failed");
+        goto exit;
+    }
+
+    fill_ops(ops, MAX_OPS, msr, num_cpu);
+    fill_ops(shared, MAX_OPS, msr, num_cpu);
+
+    printf("%8s %14s %14s %8s\n", "numops", "copy_ns", "region_ns", "speedup");
+    for (numops = MIN_OPS; numops <= MAX_OPS; numops *= 2)
+    {
+        double copy_ns = time_copy(fd, ops, numops, seconds);
+        double region_ns = time_region(fd, region.region, numops, seconds);
+        if (copy_ns < 0.0 || region_ns < 0.0)
+        {
+            err = -1;
+            goto exit;
+        }
+        printf("%8u %14.0f %14.0f %8.2f\n", numops, copy_ns, region_ns, copy_ns / region_ns);
+    }
+
+exit:
+    if (shared != MAP_FAILED)
+    {
+        munmap(shared, MAX_OPS * sizeof(*shared));
+    }
+    if (ops)
+    {
+        free(ops);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return err;
+}
@@ -0,0 +1,328 @@
+/*
+#  Copyright (c) 2011, 2012, 2013, 2014, 2015 by Lawrence Livermore National Security, LLC. LLNL-CODE-645430
+#  Produced at the Lawrence Livermore National Laboratory.
+#  Written by Marty McFadden, Kathleen Shoga and Barry Rountree (mcfadden1|shoga1|rountree@llnl.gov).
+#  All rights reserved.
+#
+#  This file is part of msr-safe.
+#
+#  msr-safe is free software: you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation, either
+#  version 3 of the License, or (at your option) any
+#  later version.
+#
+#  msr-safe is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along
+#  with msr-safe. If not, see <http://www.gnu.org/licenses/>.
+#
+#  This material is based upon work supported by the U.S. Department
+#  of Energy's Lawrence Livermore National Laboratory. Office of
+#  Science, under Award number DE-AC52-07NA27344.
+*/
+/*
+ * Measure whitelist lookups per second with the block index the module
+ * builds (msr_wlindex.c, compiled in unchanged) against the 64-bucket
+ * hash table of whitelist entries it replaced.
+ *
+ * usage: msr_wlindex_bench [-t seconds] whitelist...
+ *
+ * Half of the queried addresses are whitelisted and half are not.  Build
+ * with CFLAGS="-O2 -mpopcnt" to match the popcnt the kernel's hweight64()
+ * uses on current CPUs.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../msr_wlindex.h"
+
+enum {
+    NUM_QUERY = 4096,
+    HASH_BITS = 6,
+};
+
+struct hash_entry
+{
+    uint64_t wmask;
+    uint64_t msr;
+    uint64_t *msrdata;
+    struct hash_entry *next;
+    struct hash_entry **pprev;
+};
+
+struct bench_key
+{
+    uint32_t msr;
+    uint32_t slot;
+    uint64_t wmask;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The kernel's hash_min() of a 64-bit key into HASH_BITS bits */
+static unsigned hash_bucket(uint64_t msr)
+{
+    return (msr * 0x61C8864680B583EBull) >> (64 - HASH_BITS);
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+    const struct bench_key *ka = (const struct bench_key *)a;
+    const struct bench_key *kb = (const struct bench_key *)b;
+    return ka->msr < kb->msr ? -1 : ka->msr > kb->msr;
+}
+
+/* Read "MSR WriteMask ..." lines, ignoring attributes and comments. */
+static int read_whitelist(const char *path, struct bench_key **keys_ptr, int *num_ptr)
+{
+    int err = 0;
+    FILE *fid = NULL;
+    char line[1024];
+    unsigned long long msr;
+    unsigned long long wmask;
+    struct bench_key *keys = NULL;
+    int num = 0;
+    int cap = 0;
+
+    fid = fopen(path, "r");
+    if (!fid)
+    {
+        err = errno ? errno : -1;
+        perror(path);
+        goto exit;
+    }
+    while (fgets(line, sizeof(line), fid))
+    {
+        if (sscanf(line, "%llx %llx", &msr, &wmask) != 2)
+        {
+            continue;
+        }
+        if (num == cap)
+        {
+            cap = cap ? 2 * cap : 256;
+            keys = (struct bench_key *)realloc(keys, cap * sizeof(*keys));
+            if (!keys)
+            {
+                err = errno ? errno : -1;
+                perror("Unable to allocate whitelist");
+                goto exit;
+            }
+        }
+        keys[num].msr = msr;
+        keys[num].slot = num;
+        keys[num].wmask = wmask;
+        ++num;
+    }
+
+exit:
+    if (fid)
+    {
+        fclose(fid);
+    }
+    if (err && keys)
+    {
+        free(keys);
+        keys = NULL;
+    }
+    *keys_ptr = keys;
+    *num_ptr = num;
+    return err;
+}
+
+static double time_index(const struct msr_wlindex *idx, const uint32_t *query, double seconds, uint64_t *sum)
+{
+    double start = now();
+    double elapsed = 0.0;
+    long calls = 0;
+    __u64 wmask;
+    int i;
+
+    do
+    {
+        for (i = 0; i < NUM_QUERY; ++i)
+        {
+            if (msr_wlindex_lookup(idx, query[i], &wmask) >= 0)
+            {
+                *sum += wmask;
+            }
+        }
+        calls += NUM_QUERY;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    return calls / elapsed;
+}
+
+/* Out of line, like msr_wlindex_lookup() and the kernel's lookup */
+static __attribute__((noinline)) struct hash_entry *hash_lookup(struct hash_entry **bucket, uint64_t msr)
+{
+    struct hash_entry *entry;
+    for (entry = bucket[hash_bucket(msr)]; entry; entry = entry->next)
+    {
+        if (entry->msr == msr)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static double time_hash(struct hash_entry **bucket, const uint32_t *query, double seconds, uint64_t *sum)
+{
+    double start = now();
+    double elapsed = 0.0;
+    long calls = 0;
+    struct hash_entry *entry;
+    int i;
+
+    do
+    {
+        for (i = 0; i < NUM_QUERY; ++i)
+        {
+            entry = hash_lookup(bucket, query[i]);
+            if (entry)
+            {
+                *sum += entry->wmask;
+            }
+        }
+        calls += NUM_QUERY;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    return calls / elapsed;
+}
+
+static int bench_whitelist(const char *path, double seconds)
+{
+    int err = 0;
+    int num = 0;
+    int i;
+    struct bench_key *keys = NULL;
+    struct hash_entry *entries = NULL;
+    struct hash_entry *bucket[1 << HASH_BITS];
+    uint32_t *msrs = NULL;
+    uint32_t query[NUM_QUERY];
+    struct msr_wlindex idx = {0, 0, NULL, NULL, NULL, 0, NULL};
+    uint64_t sum = 0;
+    double index_rate;
+    double hash_rate;
+
+    err = read_whitelist(path, &keys, &num);
+    if (err)
+    {
+        goto exit;
+    }
+    if (num == 0)
+    {
+        fprintf(stderr, "%s: no entries\n", path);
+        goto exit;
+    }
+
+    /* The old table: entries in file order, chained from 64 buckets */
+    entries = (struct hash_entry *)calloc(num, sizeof(*entries));
+    msrs = (uint32_t *)malloc(num * sizeof(*msrs));
+    idx.blocks = (struct msr_wlindex_block *)malloc(msr_wlindex_nblocks(num) * sizeof(*idx.blocks));
+    idx.wmask = (__u64 *)malloc(num * sizeof(*idx.wmask));
+    idx.slot = (__u32 *)malloc(num * sizeof(*idx.slot));
+    if (!entries || !msrs || !idx.blocks || !idx.wmask || !idx.slot)
+    {
+        err = errno ? errno : -1;
+        perror("Unable to allocate tables");
+        goto exit;
+    }
+    memset(bucket, 0, sizeof(bucket));
+    for (i = 0; i < num; ++i)
+    {
+        unsigned b = hash_bucket(keys[i].msr);
+        entries[i].msr = keys[i].msr;
+        entries[i].wmask = keys[i].wmask;
+        entries[i].next = bucket[b];
+        bucket[b] = &entries[i];
+    }
+
+    /* The new index, built the way the module builds it */
+    qsort(keys, num, sizeof(*keys), cmp_key);
+    for (i = 0; i < num; ++i)
+    {
+        msrs[i] = keys[i].msr;
+        idx.wmask[i] = keys[i].wmask;
+        idx.slot[i] = keys[i].slot;
+    }
+    msr_wlindex_build(&idx, msrs, num);
+
+    srand(1);
+    for (i = 0; i < NUM_QUERY; ++i)
+    {
+        query[i] = keys[rand() % num].msr;
+        if (i % 2)
+        {
+            query[i] += 0x10000;
+        }
+    }
+
+    index_rate = time_index(&idx, query, seconds, &sum);
+    hash_rate = time_hash(bucket, query, seconds, &sum);
+    printf("%-24s %6d %6u %14.0f %14.0f %8.2f\n", path, num, idx.nused,
+           index_rate, hash_rate, index_rate / hash_rate);
+    if (sum == 0)
+    {
+        printf("(no write masks)\n");
+    }
+
+exit:
+    free(idx.slot);
+    free(idx.wmask);
+    free(idx.blocks);
+    free(msrs);
+    free(entries);
+    free(keys);
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    int opt;
+    double seconds = 0.5;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] whitelist...\n", argv[0]);
+                return -1;
+        }
+    }
+    if (optind == argc)
+    {
+        fprintf(stderr, "usage: %s [-t seconds] whitelist...\n", argv[0]);
+        return -1;
+    }
+
+    printf("%-24s %6s %6s %14s %14s %8s\n", "whitelist", "msrs", "blocks",
+           "index_per_s", "hash_per_s", "speedup");
+    for (; optind < argc && !err; ++optind)
+    {
+        err = bench_whitelist(argv[optind], seconds);
+    }
+    return err;
+}
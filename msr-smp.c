@@ -37,25 +37,41 @@
 #include <linux/preempt.h>
 #include <linux/smp.h>
 #include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/cache.h>
 #include <asm/msr.h>
 #include "msr.h"
+#include "msr_vreg.h"
+
+/*
+ * Ops are grouped into one slice per target CPU.  Each slice is allocated
+ * on the target CPU's node and its ops start on a cache line of their own,
+ * so an IPI handler only walks (and only dirties) the ops it executes.
+ * Results are scattered back to the caller's array after the IPIs finish.
+ */
+struct msr_batch_slice {
+	u32 numops;
+	u32 *index;			/* Position of each op in oa->ops */
+	struct msr_batch_op ops[0] ____cacheline_aligned;
+};
+
+struct msr_batch_plan {
+	struct cpumask cpus_to_run_on;
+	struct msr_batch_slice **slices;	/* Array[nr_cpu_ids] */
+};
 
 static void __msr_safe_batch(void *info)
 {
-	struct msr_batch_array *oa = info;
+	struct msr_batch_plan *plan = info;
+	struct msr_batch_slice *slice = plan->slices[smp_processor_id()];
 	struct msr_batch_op *op;
-	int this_cpu = smp_processor_id();
-	u32 *dp;
 	u64 oldmsr;
 	u64 newmsr;
 
-	for (op = oa->ops; op < oa->ops + oa->numops; ++op) {
-		if (op->cpu != this_cpu)
-			continue;
-
+	for (op = slice->ops; op < slice->ops + slice->numops; ++op) {
 		op->err = 0;
-		dp = (u32 *)&oldmsr;
-		if (rdmsr_safe(op->msr, &dp[0], &dp[1])) {
+		if (msr_vreg_rdmsrl_safe(op->msr, &oldmsr)) {
 			op->err = -EIO;
 			continue;
 		}
@@ -63,25 +79,117 @@ static void __msr_safe_batch(void *info)
 			op->msrdata = oldmsr;
 			continue;
 		}
+		if (MSR_SAFE_IS_VIRT(op->msr)) {
+			op->err = -EIO;	/* Virtual MSRs are read-only */
+			continue;
+		}
 
 		newmsr = op->msrdata & op->wmask;
 		newmsr |= (oldmsr & ~op->wmask);
-		dp = (u32 *)&newmsr;
-		if (wrmsr_safe(op->msr, dp[0], dp[1]))
+		if (msr_vreg_wrmsrl_safe(op->msr, newmsr))
 			op->err = -EIO;
 	}
 }
 
-int msr_safe_batch(struct msr_batch_array *oa)
+void msr_safe_batch_plan_free(struct msr_batch_plan *plan)
 {
-	struct cpumask cpus_to_run_on;
+	int cpu;
+
+	if (!plan)
+		return;
+
+	for_each_cpu(cpu, &plan->cpus_to_run_on)
+		kfree(plan->slices[cpu]);
+	kfree(plan->slices);
+	kfree(plan);
+}
+
+struct msr_batch_plan *msr_safe_batch_plan(struct msr_batch_array *oa)
+{
+	struct msr_batch_plan *plan;
+	struct msr_batch_slice *slice;
 	struct msr_batch_op *op;
+	u32 *counts;
+	size_t size;
+	int cpu;
+	u32 i;
 
-	cpumask_clear(&cpus_to_run_on);
 	for (op = oa->ops; op < oa->ops + oa->numops; ++op)
-		cpumask_set_cpu(op->cpu, &cpus_to_run_on);
+		if (op->cpu >= nr_cpu_ids)
+			return ERR_PTR(-ENXIO);
+
+	counts = kcalloc(nr_cpu_ids, sizeof(*counts), GFP_KERNEL);
+	plan = kzalloc(sizeof(*plan), GFP_KERNEL);
+	if (!counts || !plan)
+		goto out_nomem;
+
+	plan->slices = kcalloc(nr_cpu_ids, sizeof(*plan->slices), GFP_KERNEL);
+	if (!plan->slices)
+		goto out_nomem;
+
+	cpumask_clear(&plan->cpus_to_run_on);
+	for (op = oa->ops; op < oa->ops + oa->numops; ++op) {
+		cpumask_set_cpu(op->cpu, &plan->cpus_to_run_on);
+		counts[op->cpu]++;
+	}
 
-	on_each_cpu_mask(&cpus_to_run_on, __msr_safe_batch, oa, 1);
+	for_each_cpu(cpu, &plan->cpus_to_run_on) {
+		size = sizeof(*slice) + counts[cpu] * sizeof(*slice->ops);
+		size = ALIGN(size + counts[cpu] * sizeof(*slice->index),
+							L1_CACHE_BYTES);
+		slice = kmalloc_node(size, GFP_KERNEL, cpu_to_node(cpu));
+		if (!slice)
+			goto out_nomem;
+		slice->numops = 0;
+		slice->index = (u32 *)(slice->ops + counts[cpu]);
+		plan->slices[cpu] = slice;
+	}
+
+	for (i = 0; i < oa->numops; ++i) {
+		slice = plan->slices[oa->ops[i].cpu];
+		slice->index[slice->numops] = i;
+		slice->ops[slice->numops] = oa->ops[i];
+		/* Left in place if the CPU goes offline before the IPI */
+		slice->ops[slice->numops].err = -ENXIO;
+		slice->numops++;
+	}
+
+	kfree(counts);
+	return plan;
+
+out_nomem:
+	kfree(counts);
+	msr_safe_batch_plan_free(plan);
+	return ERR_PTR(-ENOMEM);
+}
+
+int msr_safe_batch_run(struct msr_batch_plan *plan, struct msr_batch_array *oa)
+{
+	struct msr_batch_slice *slice;
+	struct msr_batch_op *op;
+	int cpu;
+	u32 i;
+
+	/* Only the value written may change between runs of one plan */
+	for_each_cpu(cpu, &plan->cpus_to_run_on) {
+		slice = plan->slices[cpu];
+		for (i = 0; i < slice->numops; ++i)
+			if (!slice->ops[i].isrdmsr)
+				slice->ops[i].msrdata =
+					oa->ops[slice->index[i]].msrdata;
+	}
+
+	on_each_cpu_mask(&plan->cpus_to_run_on, __msr_safe_batch, plan, 1);
+
+	for_each_cpu(cpu, &plan->cpus_to_run_on) {
+		slice = plan->slices[cpu];
+		for (i = 0; i < slice->numops; ++i) {
+			op = &oa->ops[slice->index[i]];
+			op->msrdata = slice->ops[i].msrdata;
+			op->err = slice->ops[i].err;
+			slice->ops[i].err = -ENXIO;
+		}
+	}
 
 	for (op = oa->ops; op < oa->ops + oa->numops; ++op)
 		if (op->err)
@@ -89,3 +197,18 @@ int msr_safe_batch(struct msr_batch_array *oa)
 
 	return 0;
 }
+
+int msr_safe_batch(struct msr_batch_array *oa)
+{
+	struct msr_batch_plan *plan;
+	int err;
+
+	plan = msr_safe_batch_plan(oa);
+	if (IS_ERR(plan))
+		return PTR_ERR(plan);
+
+	err = msr_safe_batch_run(plan, oa);
+	msr_safe_batch_plan_free(plan);
+
+	return err;
+}
@@ -1,6 +1,4 @@
 /*
-<<<<<<< HEAD
-=======
 #  Copyright (c) 2011, 2012, 2013, 2014, 2015 by Lawrence Livermore National Security, LLC. LLNL-CODE-645430
 #  Produced at the Lawrence Livermore National Laboratory.
 #  Written by Marty McFadden, Kathleen Shoga and Barry Rountree (mcfadden1|shoga1|rountree@llnl.gov).
@@ -30,7 +28,6 @@
 /*
  * (proposed) extensions to arch/x86/include/asm/msr.h
  *
->>>>>>> d7ccb3efe28f6d08882197cd71549354598d025f
  * This file defines linux kernel data structures and function prototypes
  * for proposed extensions to arch/x86/lib/msr_smp.c that will allow for
  * batching rdmsr/wrmsr requests.
@@ -42,6 +39,100 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
+/*
+ * Addresses 0x80000000-0x9fffffff never name hardware MSRs; msr-safe uses
+ * them for read-only registers it maintains itself.  A whitelisted counter
+ * declared with width=N (msr < 0x10000000) can be read at MSR_SAFE_ACCUM
+ * as a 64-bit count that is extended across wraps of its N bits.
+ */
+#define MSR_SAFE_VIRT_BASE	0x80000000u
+#define MSR_SAFE_IS_VIRT(msr)	(((msr) & 0xe0000000u) == MSR_SAFE_VIRT_BASE)
+#define MSR_SAFE_ACCUM_LIMIT	0x10000000u
+#define MSR_SAFE_ACCUM(msr)	(MSR_SAFE_VIRT_BASE | (msr))
+
+/*
+ * Addresses 0x90000000-0x9fffffff are derived registers defined in the
+ * whitelist with delta=, rate= or ratio= attributes.  They are computed
+ * from the last two periodic samples of their inputs.
+ */
+#define MSR_SAFE_DERIVED_BASE	0x90000000u
+#define MSR_SAFE_IS_DERIVED(msr) (((msr) & 0xf0000000u) == MSR_SAFE_DERIVED_BASE)
+
+/*
+ * Besides the text format, /dev/cpu/msr_whitelist accepts a binary image:
+ * a msr_whitelist_header, nrecords msr_whitelist_record sorted by ascending
+ * msr, each starting above the last MSR of the one before, and then nattrs
+ * msr_whitelist_attr sorted the same way.  Records without attributes have
+ * no msr_whitelist_attr, and one covers a run of records with the same
+ * attributes.  The image is loaded as is, without parsing; msr_wlcompile
+ * converts text whitelists into images.
+ */
+#define MSR_WHITELIST_MAGIC	0x4c57534du	/* "MSWL" little-endian */
+#define MSR_WHITELIST_VERSION	1
+
+struct msr_whitelist_header {
+	__u32 magic;			/* MSR_WHITELIST_MAGIC */
+	__u32 version;			/* MSR_WHITELIST_VERSION */
+	__u32 nrecords;			/* # of records that follow */
+	__u32 nattrs;			/* # of attributes after the records */
+};
+
+struct msr_whitelist_record {
+	__u32 msr;
+	__u32 last;			/* Last MSR of a range, or 0 */
+	__u64 wmask;			/* Write mask */
+};
+
+/* Values of msr_whitelist_attr.op, for derived registers */
+#define MSR_WHITELIST_DELTA	1	/* delta=in[0] */
+#define MSR_WHITELIST_RATE	2	/* rate=in[0] */
+#define MSR_WHITELIST_RATIO	3	/* ratio=in[0]/in[1] */
+
+/*
+ * Values of msr_whitelist_attr.scope: the CPUs that share one instance of
+ * the MSR.  The module only records it, for tools such as msrsave that
+ * access each instance once.
+ */
+#define MSR_WHITELIST_THREAD	0	/* scope=thread, the default */
+#define MSR_WHITELIST_CORE	1	/* scope=core */
+#define MSR_WHITELIST_MODULE	2	/* scope=module */
+#define MSR_WHITELIST_PACKAGE	3	/* scope=package */
+
+/* Attributes of the records starting from msr up to last */
+struct msr_whitelist_attr {
+	__u32 msr;			/* msr of the first record */
+	__u32 last;			/* msr of the last record, or 0 */
+	__u32 width;			/* width=, or 0 */
+	__u32 op;			/* MSR_WHITELIST_*, or 0 */
+	__u32 scope;			/* MSR_WHITELIST_THREAD etc. */
+	__u32 in[2];			/* Inputs of a derived register */
+	__u32 pad;
+	__u64 scale;			/* scale=, or 0 for the default */
+};
+
+/*
+ * X86_IOC_MSR_WHITELIST_DUMP on /dev/cpu/msr_whitelist copies the installed
+ * whitelist out as records and attributes in ascending MSR order, as in an
+ * image.  If nrecords or nattrs is too small for them it fails with
+ * -ENOSPC; either way both are set to the # the whitelist holds.
+ */
+struct msr_whitelist_dump {
+	__u32 nrecords;			/* In/Out: see above */
+	__u32 nattrs;			/* In/Out: see above */
+	struct msr_whitelist_record *records;	/* Out: Array[nrecords] */
+	struct msr_whitelist_attr *attrs;	/* Out: Array[nattrs] */
+};
+
+/*
+ * X86_IOC_MSR_WHITELIST_SAVE on /dev/cpu/msr_whitelist, open for writing,
+ * has the module read every writable whitelisted MSR on every online CPU
+ * and keep the values, replacing any earlier snapshot.
+ * X86_IOC_MSR_WHITELIST_RESTORE writes back the writable bits that have
+ * changed since, so far as the installed whitelist still allows.  It fails
+ * with -ENODATA if nothing was saved and -EIO if any MSR could not be
+ * read or written; the others are still restored.
+ */
+
 struct msr_batch_op {
 	__u16 cpu;		/* In: CPU to execute {rd/wr}msr ins. */
 	__u16 isrdmsr;		/* In: 0=wrmsr, non-zero=rdmsr */
@@ -56,9 +147,143 @@ struct msr_batch_array {
 	struct msr_batch_op *ops;	/* In: Array[numops] of operations */
 };
 
+/*
+ * A batch program is an op array that is copied in and checked against the
+ * whitelist once, then executed any number of times by handle.  A run only
+ * copies the msrdata of each op back out, in op order.  Registering a new
+ * whitelist invalidates every program; running a stale one fails with
+ * -ESTALE and the program must be registered again.
+ */
+struct msr_batch_program {
+	__u32 numops;			/* In: # of operations in ops array */
+	__u32 handle;			/* Out: Handle to pass to RUN/UNREGISTER */
+	struct msr_batch_op *ops;	/* In: Array[numops] of operations */
+};
+
+struct msr_batch_run {
+	__u32 handle;			/* In: Handle of registered program */
+	__u32 numresults;		/* In: # of entries in results array */
+	__u64 *results;			/* Out: Array[numops] of op msrdata */
+};
+
+/*
+ * A region is an array of msr_batch_op shared with the kernel through
+ * mmap() of /dev/cpu/msr_batch at the returned offset.  Running a region
+ * reads the ops in place and writes msrdata, wmask and err back in place,
+ * so no op data passes through copy_{from,to}_user.  The kernel keeps its
+ * own copy of the checked cpu/isrdmsr/msr fields and rechecks any op
+ * whose fields userspace has changed since the last run.  CREATE fails
+ * with -E2BIG for more than MSR_BATCH_REGION_MAX_OPS ops, or when the file
+ * already holds MSR_BATCH_MAX_REGIONS regions.
+ */
+#define MSR_BATCH_REGION_MAX_OPS	65536
+#define MSR_BATCH_MAX_REGIONS		64
+
+struct msr_batch_region {
+	__u32 numops;			/* In: # of ops the region holds */
+	__u32 region;			/* Out: Region # to pass to RUN */
+	__u64 offset;			/* Out: mmap() offset of the ops */
+};
+
+struct msr_batch_region_run {
+	__u32 region;			/* In: Region # to run */
+	__u32 numops;			/* In: # of leading ops to run */
+};
+
+/*
+ * A submitted region runs asynchronously.  When it finishes, a completion
+ * is queued on the file: poll() reports POLLIN and read() returns whole
+ * msr_batch_completion records.  Per-op results and errors are found in
+ * the region's ops, as after X86_IOC_MSR_BATCH_REGION_RUN.  A region stays
+ * busy (-EBUSY for RUN, SUBMIT and DESTROY) until its completion is read.
+ */
+struct msr_batch_submit {
+	__u32 region;			/* In: Region # to run */
+	__u32 numops;			/* In: # of leading ops to run */
+	__u64 user_data;		/* In: Returned in the completion */
+};
+
+struct msr_batch_completion {
+	__u64 user_data;		/* Out: user_data of the submission */
+	__u32 region;			/* Out: Region # that ran */
+	__s32 err;			/* Out: First op error, or 0 */
+};
+
+/*
+ * The sampler (/dev/cpu/msr_sampler) runs a pinned hrtimer on every CPU
+ * named in its rdmsr ops.  Each tick executes that CPU's ops locally and
+ * appends a msr_sampler_record to the CPU's ring, which is mapped
+ * read-only at mmap() offset cpu * ring_size.  Values within a record are
+ * in the order the CPU's ops were given.  A ring is overwritten once full;
+ * a reader copies records below head, then re-reads head to see whether
+ * any were overwritten meanwhile.  Sampling on a CPU stops (flags gets
+ * MSR_SAMPLER_STOPPED) when the whitelist changes or the CPU goes away.
+ * START fails, with no CPU left sampling, if a CPU cannot be started.
+ * It fails with -E2BIG for more than MSR_SAMPLER_MAX_CPU_OPS ops on one CPU
+ * or rings of more than MSR_SAMPLER_MAX_RING_SIZE bytes, and with -EINVAL
+ * for a period shorter than MSR_SAMPLER_OP_NS for each op on a CPU.
+ */
+#define MSR_SAMPLER_MAX_CPU_OPS		64
+#define MSR_SAMPLER_MAX_RING_SIZE	(4 << 20)
+#define MSR_SAMPLER_OP_NS		1000	/* Allowance per rdmsr per tick */
+
+struct msr_sampler_config {
+	__u32 numops;			/* In: # of rdmsr ops in ops array */
+	__u32 nrecords;			/* In: # of records per CPU ring */
+	__u64 period_ns;		/* In: Sampling period */
+	struct msr_batch_op *ops;	/* In/Out: Array[numops] of ops */
+	__u64 ring_size;		/* Out: Bytes mapped per CPU */
+};
+
+struct msr_sampler_ring {
+	__u64 head;			/* # of records written so far */
+	__u64 errors;			/* # of reads that faulted (read as 0) */
+	__u32 cpu;
+	__u32 numops;			/* # of msrdata per record */
+	__u32 nrecords;
+	__u32 record_size;		/* Bytes per record */
+	__u32 data_offset;		/* Offset of record 0 from ring */
+	__u32 flags;
+};
+
+#define MSR_SAMPLER_STOPPED	0x1
+
+struct msr_sampler_record {
+	__u64 timestamp;		/* CLOCK_MONOTONIC ns of the tick */
+	__u64 msrdata[0];		/* Array[ring numops] */
+};
+
+/*
+ * By default each 8 bytes of a read() of /dev/cpu/N/msr_safe return the
+ * MSR at the file offset again.  After X86_IOC_MSR_SAFE_SET_MODE selects
+ * MSR_SAFE_MODE_CONSECUTIVE, a read of N * 8 bytes returns the N
+ * consecutive MSRs starting at the offset, collected in one IPI.  Every
+ * one of them must be whitelisted; the read stops short at the first that
+ * is not.
+ */
+#define MSR_SAFE_MODE_CONSECUTIVE	0x1
+
 #define X86_IOC_MSR_BATCH	_IOWR('c', 0xA2, struct msr_batch_array)
+#define X86_IOC_MSR_BATCH_REGISTER _IOWR('c', 0xA3, struct msr_batch_program)
+#define X86_IOC_MSR_BATCH_RUN	_IOW('c', 0xA4, struct msr_batch_run)
+#define X86_IOC_MSR_BATCH_UNREGISTER _IOW('c', 0xA5, __u32)
+#define X86_IOC_MSR_BATCH_REGION_CREATE _IOWR('c', 0xA6, struct msr_batch_region)
+#define X86_IOC_MSR_BATCH_REGION_RUN _IOW('c', 0xA7, struct msr_batch_region_run)
+#define X86_IOC_MSR_BATCH_REGION_DESTROY _IOW('c', 0xA8, __u32)
+#define X86_IOC_MSR_BATCH_REGION_SUBMIT _IOW('c', 0xA9, struct msr_batch_submit)
+#define X86_IOC_MSR_SAMPLER_START _IOWR('c', 0xAA, struct msr_sampler_config)
+#define X86_IOC_MSR_SAMPLER_STOP _IO('c', 0xAB)
+#define X86_IOC_MSR_SAFE_SET_MODE _IOW('c', 0xAC, __u32)
+#define X86_IOC_MSR_WHITELIST_DUMP _IOWR('c', 0xAD, struct msr_whitelist_dump)
+#define X86_IOC_MSR_WHITELIST_SAVE _IO('c', 0xAE)
+#define X86_IOC_MSR_WHITELIST_RESTORE _IO('c', 0xAF)
 
 #ifdef __KERNEL__
+struct msr_batch_plan;
+
 int msr_safe_batch(struct msr_batch_array *oa);
+struct msr_batch_plan *msr_safe_batch_plan(struct msr_batch_array *oa);
+int msr_safe_batch_run(struct msr_batch_plan *plan, struct msr_batch_array *oa);
+void msr_safe_batch_plan_free(struct msr_batch_plan *plan);
 #endif /* __KERNEL__ */
 #endif /*  MSR_HFILE_INC */
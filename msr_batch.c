@@ -17,6 +17,12 @@
 #include <linux/cpu.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
 #include <linux/module.h>
@@ -30,11 +36,49 @@ static struct class *cdev_class;
 static char cdev_created;
 static char cdev_registered;
 static char cdev_class_created;
+static struct workqueue_struct *msrbatch_wq;
 
 struct msrbatch_session_info {
 	int rawio_allowed;
+	struct mutex lock;	/* Protects programs, regions and op arrays */
+	struct idr programs;	/* Registered msrbatch_program by handle */
+	struct idr regions;	/* Mappable msrbatch_region by region # */
+	unsigned long next_pgoff; /* mmap offset (pages) of next region */
+	struct list_head done;	/* Completed regions, oldest first */
+	wait_queue_head_t wq;	/* Woken when a region completes */
 };
 
+struct msrbatch_program {
+	struct msr_batch_array oa;	/* Whitelist-checked kernel copy */
+	struct msr_batch_plan *plan;	/* oa partitioned by target CPU */
+	u64 *results;			/* Array[oa.numops] copied to user */
+	u64 generation;			/* Whitelist generation checked against */
+};
+
+enum msrbatch_region_state {
+	MSRBATCH_REGION_IDLE,
+	MSRBATCH_REGION_BUSY,		/* Running, or completion unread */
+};
+
+struct msrbatch_region {
+	struct msr_batch_op *shared;	/* Array[numops] mapped by user */
+	u32 numops;
+	u32 id;
+	enum msrbatch_region_state state;
+	struct msrbatch_session_info *myinfo;
+	struct work_struct work;	/* Runs a submitted region */
+	u32 submit_numops;		/* numops of the submission */
+	struct list_head done;		/* On myinfo->done once completed */
+	struct msr_batch_completion completion;
+	unsigned long pgoff;		/* mmap offset in pages */
+	unsigned long size;		/* Page-aligned size of shared */
+	struct msr_batch_array oa;	/* Checked copy of the first oa.numops */
+	struct msr_batch_plan *plan;	/* Partitioning of oa, or NULL */
+	u64 generation;
+};
+
+static void msrbatch_region_work(struct work_struct *work);
+
 static int msrbatch_open(struct inode *inode, struct file *file)
 {
 	unsigned int cpu;
@@ -58,14 +102,51 @@ static int msrbatch_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	myinfo->rawio_allowed = capable(CAP_SYS_RAWIO);
+	mutex_init(&myinfo->lock);
+	idr_init(&myinfo->programs);
+	idr_init(&myinfo->regions);
+	myinfo->next_pgoff = 0;
+	INIT_LIST_HEAD(&myinfo->done);
+	init_waitqueue_head(&myinfo->wq);
 	file->private_data = myinfo;
 
 	return 0;
 }
 
+static void msrbatch_free_program(struct msrbatch_program *prog)
+{
+	msr_safe_batch_plan_free(prog->plan);
+	kfree(prog->results);
+	kfree(prog->oa.ops);
+	kfree(prog);
+}
+
+static void msrbatch_free_region(struct msrbatch_region *region)
+{
+	msr_safe_batch_plan_free(region->plan);
+	vfree(region->oa.ops);
+	vfree(region->shared);
+	kfree(region);
+}
+
 static int msrbatch_close(struct inode *inode, struct file *file)
 {
-	kfree(file->private_data);
+	struct msrbatch_session_info *myinfo = file->private_data;
+	struct msrbatch_program *prog;
+	struct msrbatch_region *region;
+	int handle;
+
+	idr_for_each_entry(&myinfo->programs, prog, handle)
+		msrbatch_free_program(prog);
+	idr_destroy(&myinfo->programs);
+
+	idr_for_each_entry(&myinfo->regions, region, handle) {
+		flush_work(&region->work);
+		msrbatch_free_region(region);
+	}
+	idr_destroy(&myinfo->regions);
+
+	kfree(myinfo);
 	file->private_data = 0;
 	return 0;
 }
@@ -90,11 +171,10 @@ static int msrbatch_apply_whitelist(struct msr_batch_array *oa,
 			continue;
 		}
 
-		if (!msr_whitelist_maskexists(op->msr)) {
+		if (!msr_whitelist_lookup(op->msr, &op->wmask)) {
 			pr_err("No whitelist entry for MSR %x\n", op->msr);
 			op->err = err = -EACCES;
 		} else {
-			op->wmask = msr_whitelist_writemask(op->msr);
 			/*
 			 * Check for read-only case
 			 */
@@ -110,25 +190,12 @@ static int msrbatch_apply_whitelist(struct msr_batch_array *oa,
 	return err;
 }
 
-static long msrbatch_ioctl(struct file *f, unsigned int ioc, unsigned long arg)
+static long msrbatch_ioctl_batch(struct msrbatch_session_info *myinfo,
+				struct msr_batch_array __user *uoa)
 {
 	int err = 0;
-	struct msr_batch_array __user *uoa;
 	struct msr_batch_op __user *uops;
 	struct msr_batch_array koa;
-	struct msrbatch_session_info *myinfo = f->private_data;
-
-	if (ioc != X86_IOC_MSR_BATCH) {
-		pr_err("Invalid ioctl op %u\n", ioc);
-		return -ENOTTY;
-	}
-
-	if (!(f->f_mode & FMODE_READ)) {
-		pr_err("File not open for reading\n");
-		return -EBADF;
-	}
-
-	uoa = (struct msr_batch_array *)arg;
 
 	if (copy_from_user(&koa, uoa, sizeof(koa))) {
 		pr_err("Copy of batch array descriptor failed\n");
@@ -176,11 +243,569 @@ bundle_alloc:
 	return err;
 }
 
+/*
+ * Copy in and check a program once.  On a whitelist failure the ops are
+ * copied back so the caller can see which op->err was set, just as for
+ * X86_IOC_MSR_BATCH.
+ */
+static long msrbatch_ioctl_register(struct msrbatch_session_info *myinfo,
+				struct msr_batch_program __user *uprog)
+{
+	int err = 0;
+	int handle;
+	struct msr_batch_program kprog;
+	struct msrbatch_program *prog;
+
+	if (copy_from_user(&kprog, uprog, sizeof(kprog))) {
+		pr_err("Copy of batch program descriptor failed\n");
+		return -EFAULT;
+	}
+
+	if (kprog.numops <= 0) {
+		pr_err("Invalid # of ops %d\n", kprog.numops);
+		return -EINVAL;
+	}
+
+	prog = kzalloc(sizeof(*prog), GFP_KERNEL);
+	if (!prog)
+		return -ENOMEM;
+
+	prog->oa.numops = kprog.numops;
+	prog->oa.ops = kmalloc_array(kprog.numops, sizeof(*prog->oa.ops),
+								GFP_KERNEL);
+	prog->results = kmalloc_array(kprog.numops, sizeof(*prog->results),
+								GFP_KERNEL);
+	if (!prog->oa.ops || !prog->results) {
+		err = -ENOMEM;
+		goto out_freeprog;
+	}
+
+	if (copy_from_user(prog->oa.ops, kprog.ops,
+				kprog.numops * sizeof(*prog->oa.ops))) {
+		pr_err("Copy of batch program failed\n");
+		err = -EFAULT;
+		goto out_freeprog;
+	}
+
+	/*
+	 * Sample the generation first so that a whitelist written while
+	 * we are checking leaves the program stale rather than trusted.
+	 */
+	prog->generation = msr_whitelist_generation();
+	err = msrbatch_apply_whitelist(&prog->oa, myinfo);
+	if (err) {
+		pr_err("Failed to apply whitelist %d\n", err);
+		if (copy_to_user(kprog.ops, prog->oa.ops,
+				kprog.numops * sizeof(*prog->oa.ops)))
+			pr_err("copy batch program back to user failed\n");
+		goto out_freeprog;
+	}
+
+	prog->plan = msr_safe_batch_plan(&prog->oa);
+	if (IS_ERR(prog->plan)) {
+		err = PTR_ERR(prog->plan);
+		prog->plan = NULL;
+		goto out_freeprog;
+	}
+
+	mutex_lock(&myinfo->lock);
+	handle = idr_alloc(&myinfo->programs, prog, 0, 0, GFP_KERNEL);
+	mutex_unlock(&myinfo->lock);
+	if (handle < 0) {
+		err = handle;
+		goto out_freeprog;
+	}
+
+	if (put_user(handle, &uprog->handle)) {
+		mutex_lock(&myinfo->lock);
+		idr_remove(&myinfo->programs, handle);
+		mutex_unlock(&myinfo->lock);
+		err = -EFAULT;
+		goto out_freeprog;
+	}
+
+	return 0;
+
+out_freeprog:
+	msrbatch_free_program(prog);
+	return err;
+}
+
+static long msrbatch_ioctl_run(struct msrbatch_session_info *myinfo,
+				struct msr_batch_run __user *urun)
+{
+	int err = 0;
+	u32 i;
+	struct msr_batch_run krun;
+	struct msrbatch_program *prog;
+
+	if (copy_from_user(&krun, urun, sizeof(krun))) {
+		pr_err("Copy of batch run descriptor failed\n");
+		return -EFAULT;
+	}
+
+	mutex_lock(&myinfo->lock);
+	prog = idr_find(&myinfo->programs, krun.handle);
+	if (!prog) {
+		err = -ENOENT;
+		goto out_unlock;
+	}
+
+	if (krun.numresults < prog->oa.numops) {
+		pr_err("Result array too small: %u < %u\n",
+					krun.numresults, prog->oa.numops);
+		err = -EINVAL;
+		goto out_unlock;
+	}
+
+	if (prog->generation != msr_whitelist_generation()) {
+		err = -ESTALE;
+		goto out_unlock;
+	}
+
+	err = msr_safe_batch_run(prog->plan, &prog->oa);
+	if (err != 0)
+		pr_err("msr_safe_batch failed: %d\n", err);
+
+	for (i = 0; i < prog->oa.numops; i++)
+		prog->results[i] = prog->oa.ops[i].msrdata;
+
+	if (copy_to_user(krun.results, prog->results,
+				prog->oa.numops * sizeof(*prog->results))) {
+		pr_err("copy batch results back to user failed\n");
+		if (!err)
+			err = -EFAULT;
+	}
+
+out_unlock:
+	mutex_unlock(&myinfo->lock);
+	return err;
+}
+
+static long msrbatch_ioctl_unregister(struct msrbatch_session_info *myinfo,
+				u32 __user *uhandle)
+{
+	u32 handle;
+	struct msrbatch_program *prog;
+
+	if (get_user(handle, uhandle))
+		return -EFAULT;
+
+	mutex_lock(&myinfo->lock);
+	prog = idr_remove(&myinfo->programs, handle);
+	mutex_unlock(&myinfo->lock);
+
+	if (!prog)
+		return -ENOENT;
+
+	msrbatch_free_program(prog);
+	return 0;
+}
+
+static long msrbatch_ioctl_region_create(struct msrbatch_session_info *myinfo,
+				struct msr_batch_region __user *ureg)
+{
+	int err = 0;
+	int id;
+	struct msr_batch_region kreg;
+	struct msrbatch_region *region;
+
+	if (copy_from_user(&kreg, ureg, sizeof(kreg))) {
+		pr_err("Copy of batch region descriptor failed\n");
+		return -EFAULT;
+	}
+
+	if (kreg.numops <= 0) {
+		pr_err("Invalid # of ops %d\n", kreg.numops);
+		return -EINVAL;
+	}
+	if (kreg.numops > MSR_BATCH_REGION_MAX_OPS) {
+		pr_err("Region of %u ops exceeds %u\n", kreg.numops,
+						MSR_BATCH_REGION_MAX_OPS);
+		return -E2BIG;
+	}
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region)
+		return -ENOMEM;
+
+	region->numops = kreg.numops;
+	region->state = MSRBATCH_REGION_IDLE;
+	region->myinfo = myinfo;
+	INIT_LIST_HEAD(&region->done);
+	INIT_WORK(&region->work, msrbatch_region_work);
+	region->size = PAGE_ALIGN((unsigned long)kreg.numops *
+						sizeof(*region->shared));
+	region->shared = vmalloc_user(region->size);
+	region->oa.ops = vmalloc((unsigned long)kreg.numops *
+						sizeof(*region->oa.ops));
+	if (!region->shared || !region->oa.ops) {
+		err = -ENOMEM;
+		goto out_freeregion;
+	}
+
+	mutex_lock(&myinfo->lock);
+	id = idr_alloc(&myinfo->regions, region, 0, MSR_BATCH_MAX_REGIONS,
+								GFP_KERNEL);
+	if (id >= 0) {
+		region->id = id;
+		region->pgoff = myinfo->next_pgoff;
+		myinfo->next_pgoff += region->size >> PAGE_SHIFT;
+	}
+	mutex_unlock(&myinfo->lock);
+	if (id < 0) {
+		/* -ENOSPC from idr_alloc() means the file holds the maximum */
+		err = id == -ENOSPC ? -E2BIG : id;
+		goto out_freeregion;
+	}
+
+	kreg.region = id;
+	kreg.offset = (u64)region->pgoff << PAGE_SHIFT;
+	if (copy_to_user(ureg, &kreg, sizeof(kreg))) {
+		mutex_lock(&myinfo->lock);
+		idr_remove(&myinfo->regions, id);
+		mutex_unlock(&myinfo->lock);
+		err = -EFAULT;
+		goto out_freeregion;
+	}
+
+	return 0;
+
+out_freeregion:
+	msrbatch_free_region(region);
+	return err;
+}
+
+/*
+ * Pull the inputs of the first numops shared ops into the region's kernel
+ * copy.  Userspace may rewrite the shared ops at any time, so every field
+ * the whitelist check depends on is read exactly once here and compared
+ * with what was last checked.  Returns 1 if the copy must be rechecked.
+ */
+static int msrbatch_region_snapshot(struct msrbatch_region *region, u32 numops)
+{
+	struct msr_batch_op *shared = region->shared;
+	struct msr_batch_op *op;
+	int changed = !region->plan || region->oa.numops != numops ||
+			region->generation != msr_whitelist_generation();
+	u16 cpu;
+	u16 isrdmsr;
+	u32 msr;
+	u32 i;
+
+	for (i = 0; i < numops; i++) {
+		op = &region->oa.ops[i];
+		cpu = READ_ONCE(shared[i].cpu);
+		isrdmsr = READ_ONCE(shared[i].isrdmsr);
+		msr = READ_ONCE(shared[i].msr);
+		op->msrdata = READ_ONCE(shared[i].msrdata);
+
+		if (changed || op->cpu != cpu || !op->isrdmsr != !isrdmsr ||
+							op->msr != msr) {
+			op->cpu = cpu;
+			op->isrdmsr = isrdmsr;
+			op->msr = msr;
+			changed = 1;
+		}
+	}
+
+	region->oa.numops = numops;
+	return changed;
+}
+
+/*
+ * Runs the first numops ops of a region the caller has marked busy, so no
+ * lock is needed for the region itself.
+ */
+static int msrbatch_region_execute(struct msrbatch_session_info *myinfo,
+				struct msrbatch_region *region, u32 numops)
+{
+	int err = 0;
+	u32 i;
+	struct msr_batch_op *op;
+
+	if (msrbatch_region_snapshot(region, numops)) {
+		msr_safe_batch_plan_free(region->plan);
+		region->plan = NULL;
+
+		region->generation = msr_whitelist_generation();
+		err = msrbatch_apply_whitelist(&region->oa, myinfo);
+		if (err) {
+			pr_err("Failed to apply whitelist %d\n", err);
+			goto copyout;
+		}
+
+		region->plan = msr_safe_batch_plan(&region->oa);
+		if (IS_ERR(region->plan)) {
+			err = PTR_ERR(region->plan);
+			region->plan = NULL;
+			return err;
+		}
+	}
+
+	err = msr_safe_batch_run(region->plan, &region->oa);
+	if (err != 0)
+		pr_err("msr_safe_batch failed: %d\n", err);
+
+copyout:
+	for (i = 0, op = region->oa.ops; i < region->oa.numops; i++, op++) {
+		WRITE_ONCE(region->shared[i].msrdata, op->msrdata);
+		WRITE_ONCE(region->shared[i].wmask, op->wmask);
+		WRITE_ONCE(region->shared[i].err, op->err);
+	}
+
+	return err;
+}
+
+/*
+ * Look up an idle region and mark it busy.  Called with myinfo->lock held.
+ */
+static struct msrbatch_region *msrbatch_region_claim(
+			struct msrbatch_session_info *myinfo, u32 id, u32 numops)
+{
+	struct msrbatch_region *region;
+
+	region = idr_find(&myinfo->regions, id);
+	if (!region)
+		return ERR_PTR(-ENOENT);
+
+	if (numops <= 0 || numops > region->numops) {
+		pr_err("Invalid # of ops %u for region of %u\n",
+						numops, region->numops);
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (region->state != MSRBATCH_REGION_IDLE)
+		return ERR_PTR(-EBUSY);
+
+	region->state = MSRBATCH_REGION_BUSY;
+	return region;
+}
+
+static long msrbatch_ioctl_region_run(struct msrbatch_session_info *myinfo,
+				struct msr_batch_region_run __user *urun)
+{
+	int err;
+	struct msr_batch_region_run krun;
+	struct msrbatch_region *region;
+
+	if (copy_from_user(&krun, urun, sizeof(krun))) {
+		pr_err("Copy of batch region run descriptor failed\n");
+		return -EFAULT;
+	}
+
+	mutex_lock(&myinfo->lock);
+	region = msrbatch_region_claim(myinfo, krun.region, krun.numops);
+	mutex_unlock(&myinfo->lock);
+	if (IS_ERR(region))
+		return PTR_ERR(region);
+
+	err = msrbatch_region_execute(myinfo, region, krun.numops);
+
+	mutex_lock(&myinfo->lock);
+	region->state = MSRBATCH_REGION_IDLE;
+	mutex_unlock(&myinfo->lock);
+
+	return err;
+}
+
+static void msrbatch_region_work(struct work_struct *work)
+{
+	struct msrbatch_region *region =
+			container_of(work, struct msrbatch_region, work);
+	struct msrbatch_session_info *myinfo = region->myinfo;
+	int err;
+
+	err = msrbatch_region_execute(myinfo, region, region->submit_numops);
+
+	mutex_lock(&myinfo->lock);
+	region->completion.err = err;
+	list_add_tail(&region->done, &myinfo->done);
+	mutex_unlock(&myinfo->lock);
+
+	wake_up_interruptible(&myinfo->wq);
+}
+
+static long msrbatch_ioctl_region_submit(struct msrbatch_session_info *myinfo,
+				struct msr_batch_submit __user *usub)
+{
+	struct msr_batch_submit ksub;
+	struct msrbatch_region *region;
+
+	if (copy_from_user(&ksub, usub, sizeof(ksub))) {
+		pr_err("Copy of batch submit descriptor failed\n");
+		return -EFAULT;
+	}
+
+	mutex_lock(&myinfo->lock);
+	region = msrbatch_region_claim(myinfo, ksub.region, ksub.numops);
+	if (!IS_ERR(region)) {
+		region->completion.user_data = ksub.user_data;
+		region->completion.region = region->id;
+		region->submit_numops = ksub.numops;
+		queue_work(msrbatch_wq, &region->work);
+	}
+	mutex_unlock(&myinfo->lock);
+
+	return IS_ERR(region) ? PTR_ERR(region) : 0;
+}
+
+static long msrbatch_ioctl_region_destroy(struct msrbatch_session_info *myinfo,
+				u32 __user *uregion)
+{
+	u32 id;
+	struct msrbatch_region *region;
+	int err = 0;
+
+	if (get_user(id, uregion))
+		return -EFAULT;
+
+	mutex_lock(&myinfo->lock);
+	region = idr_find(&myinfo->regions, id);
+	if (!region)
+		err = -ENOENT;
+	else if (region->state != MSRBATCH_REGION_IDLE)
+		err = -EBUSY;
+	else
+		idr_remove(&myinfo->regions, id);
+	mutex_unlock(&myinfo->lock);
+
+	if (err)
+		return err;
+
+	/* Pages still mapped by userspace stay valid until munmap() */
+	msrbatch_free_region(region);
+	return 0;
+}
+
+#define MSRBATCH_READ_BATCH 16	/* Completions gathered per lock hold */
+
+static ssize_t msrbatch_read(struct file *f, char __user *buf,
+						size_t count, loff_t *ppos)
+{
+	struct msrbatch_session_info *myinfo = f->private_data;
+	struct msr_batch_completion kc[MSRBATCH_READ_BATCH];
+	struct msrbatch_region *region;
+	ssize_t bytes = 0;
+	int n;
+	int err;
+
+	if (count < sizeof(*kc))
+		return -EINVAL;
+
+	while (count >= sizeof(*kc)) {
+		mutex_lock(&myinfo->lock);
+		for (n = 0; n < MSRBATCH_READ_BATCH && count >= sizeof(*kc) &&
+					!list_empty(&myinfo->done); n++) {
+			region = list_first_entry(&myinfo->done,
+					struct msrbatch_region, done);
+			list_del_init(&region->done);
+			kc[n] = region->completion;
+			region->state = MSRBATCH_REGION_IDLE;
+			count -= sizeof(*kc);
+		}
+		mutex_unlock(&myinfo->lock);
+
+		if (n == 0) {
+			if (bytes)
+				break;
+			if (f->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			err = wait_event_interruptible(myinfo->wq,
+						!list_empty(&myinfo->done));
+			if (err)
+				return err;
+			continue;
+		}
+
+		if (copy_to_user(buf + bytes, kc, n * sizeof(*kc)))
+			return bytes ? bytes : -EFAULT;
+		bytes += n * sizeof(*kc);
+	}
+
+	return bytes;
+}
+
+static unsigned int msrbatch_poll(struct file *f, poll_table *wait)
+{
+	struct msrbatch_session_info *myinfo = f->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(f, &myinfo->wq, wait);
+
+	mutex_lock(&myinfo->lock);
+	if (!list_empty(&myinfo->done))
+		mask |= POLLIN | POLLRDNORM;
+	mutex_unlock(&myinfo->lock);
+
+	return mask;
+}
+
+static int msrbatch_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct msrbatch_session_info *myinfo = f->private_data;
+	struct msrbatch_region *region;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int err = -EINVAL;
+	int id;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&myinfo->lock);
+	idr_for_each_entry(&myinfo->regions, region, id) {
+		if (region->pgoff != vma->vm_pgoff)
+			continue;
+		if (size <= region->size)
+			err = remap_vmalloc_range(vma, region->shared, 0);
+		break;
+	}
+	mutex_unlock(&myinfo->lock);
+
+	return err;
+}
+
+static long msrbatch_ioctl(struct file *f, unsigned int ioc, unsigned long arg)
+{
+	struct msrbatch_session_info *myinfo = f->private_data;
+
+	if (!(f->f_mode & FMODE_READ)) {
+		pr_err("File not open for reading\n");
+		return -EBADF;
+	}
+
+	switch (ioc) {
+	case X86_IOC_MSR_BATCH:
+		return msrbatch_ioctl_batch(myinfo, (void __user *)arg);
+	case X86_IOC_MSR_BATCH_REGISTER:
+		return msrbatch_ioctl_register(myinfo, (void __user *)arg);
+	case X86_IOC_MSR_BATCH_RUN:
+		return msrbatch_ioctl_run(myinfo, (void __user *)arg);
+	case X86_IOC_MSR_BATCH_UNREGISTER:
+		return msrbatch_ioctl_unregister(myinfo, (void __user *)arg);
+	case X86_IOC_MSR_BATCH_REGION_CREATE:
+		return msrbatch_ioctl_region_create(myinfo, (void __user *)arg);
+	case X86_IOC_MSR_BATCH_REGION_RUN:
+		return msrbatch_ioctl_region_run(myinfo, (void __user *)arg);
+	case X86_IOC_MSR_BATCH_REGION_DESTROY:
+		return msrbatch_ioctl_region_destroy(myinfo,
+							(void __user *)arg);
+	case X86_IOC_MSR_BATCH_REGION_SUBMIT:
+		return msrbatch_ioctl_region_submit(myinfo, (void __user *)arg);
+	default:
+		pr_err("Invalid ioctl op %u\n", ioc);
+		return -ENOTTY;
+	}
+}
+
 static const struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = msrbatch_open,
+	.read = msrbatch_read,
+	.poll = msrbatch_poll,
 	.unlocked_ioctl = msrbatch_ioctl,
 	.compat_ioctl = msrbatch_ioctl,
+	.mmap = msrbatch_mmap,
 	.release = msrbatch_close
 };
 
@@ -200,6 +825,11 @@ void msrbatch_cleanup(void)
 		cdev_registered = 0;
 		unregister_chrdev(majordev, "cpu/msr_batch");
 	}
+
+	if (msrbatch_wq) {
+		destroy_workqueue(msrbatch_wq);
+		msrbatch_wq = NULL;
+	}
 }
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,39)
@@ -216,6 +846,12 @@ int msrbatch_init(void)
 	int err;
 	struct device *dev;
 
+	msrbatch_wq = alloc_workqueue("msr_batch", WQ_UNBOUND, 0);
+	if (!msrbatch_wq) {
+		pr_err("msrbatch_init: unable to allocate workqueue\n");
+		return -ENOMEM;
+	}
+
 	majordev = register_chrdev(0, "cpu/msr_batch", &fops);
 	if (majordev < 0) {
 		pr_err("msrbatch_init: unable to register chrdev\n");
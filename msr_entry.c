@@ -46,11 +46,36 @@
 #include <asm/msr.h>
 #include "msr_whitelist.h"
 #include "msr_batch.h"
+#include "msr_sampler.h"
+#include "msr_vreg.h"
+#include "msr.h"
 
 static struct class *msr_class;
 static int majordev;
 struct msr_session_info {
 	int rawio_allowed;
+	u32 mode;	/* MSR_SAFE_MODE_* flags */
+};
+
+#define MSR_READ_MAX_REGS 64	/* Consecutive MSRs read per IPI */
+
+struct msr_read_info {
+	u32 reg;	/* First MSR to read */
+	int nregs;	/* # of MSRs to read */
+	int done;	/* # of MSRs read before any error */
+	int err;
+	u64 data[MSR_READ_MAX_REGS];
+};
+
+#define MSR_WRITE_MAX_VALS 64	/* Values written per IPI */
+
+struct msr_write_info {
+	u32 reg;
+	int nvals;	/* # of values to write in turn */
+	int done;	/* # of values written before any error */
+	int err;
+	u64 mask;	/* Bits of each value to write */
+	u64 data[MSR_WRITE_MAX_VALS];
 };
 
 static loff_t msr_seek(struct file *file, loff_t offset, int orig)
@@ -83,6 +108,69 @@ static loff_t msr_seek(struct file *file, loff_t offset, int orig)
 	return ret;
 }
 
+static void __msr_read_regs(void *info)
+{
+	struct msr_read_info *ri = info;
+
+	ri->err = 0;
+	for (ri->done = 0; ri->done < ri->nregs; ri->done++) {
+		ri->err = msr_vreg_rdmsrl_safe(ri->reg + ri->done,
+						&ri->data[ri->done]);
+		if (ri->err)
+			break;
+	}
+}
+
+/*
+ * MSR_SAFE_MODE_CONSECUTIVE read: up to MSR_READ_MAX_REGS whitelisted
+ * MSRs are read per IPI to the target CPU.
+ */
+static ssize_t msr_read_consecutive(struct file *file, char __user *buf,
+			size_t count, u32 reg)
+{
+	int cpu = iminor(file->f_path.dentry->d_inode);
+	struct msr_session_info *myinfo = file->private_data;
+	struct msr_read_info *ri;
+	ssize_t bytes = 0;
+	int err = 0;
+	int n;
+	int last = 0;
+
+	ri = kmalloc(sizeof(*ri), GFP_KERNEL);
+	if (!ri)
+		return -ENOMEM;
+
+	while (count && !last && !err) {
+		n = min_t(size_t, count / 8, MSR_READ_MAX_REGS);
+		for (ri->nregs = 0; ri->nregs < n; ri->nregs++)
+			if (!myinfo->rawio_allowed &&
+			    !msr_whitelist_maskexists(reg + ri->nregs))
+				break;
+		if (ri->nregs == 0) {
+			err = -EACCES;
+			break;
+		}
+		last = ri->nregs < n;	/* Stop short at a non-whitelisted MSR */
+
+		ri->reg = reg;
+		err = smp_call_function_single(cpu, __msr_read_regs, ri, 1);
+		if (err)
+			break;
+		if (copy_to_user(buf + bytes, ri->data, ri->done * 8)) {
+			err = -EFAULT;
+			break;
+		}
+
+		bytes += ri->done * 8;
+		count -= ri->done * 8;
+		reg += ri->done;
+		err = ri->err;
+	}
+
+	kfree(ri);
+	return bytes ? bytes : err;
+}
+
 static ssize_t msr_read(struct file *file, char __user *buf,
 			size_t count, loff_t *ppos)
 {
@@ -97,11 +185,18 @@ static ssize_t msr_read(struct file *file, char __user *buf,
 	if (count % 8)
 		return -EINVAL;	/* Invalid chunk size */
 
+	if (myinfo->mode & MSR_SAFE_MODE_CONSECUTIVE)
+		return msr_read_consecutive(file, buf, count, reg);
+
 	if (!myinfo->rawio_allowed && !msr_whitelist_maskexists(reg))
 		return -EACCES;
 
 	for (; count; count -= 8) {
-		err = rdmsr_safe_on_cpu(cpu, reg, &data[0], &data[1]);
+		if (MSR_SAFE_IS_VIRT(reg))
+			err = msr_vreg_rdmsrl_safe_on_cpu(cpu, reg,
+							(u64 *)&data[0]);
+		else
+			err = rdmsr_safe_on_cpu(cpu, reg, &data[0], &data[1]);
 		if (err)
 			break;
 		if (copy_to_user(tmp, &data, 8)) {
@@ -115,18 +210,44 @@ static ssize_t msr_read(struct file *file, char __user *buf,
 	return bytes ? bytes : err;
 }
 
+/*
+ * Unless every bit is writable, each value is merged into the current
+ * contents of the MSR on the target CPU itself, so no other write to the
+ * MSR from that CPU can slip in between the read and the write.
+ */
+static void __msr_write_regs(void *info)
+{
+	struct msr_write_info *wi = info;
+	u64 val;
+	u64 cur;
+
+	wi->err = 0;
+	for (wi->done = 0; wi->done < wi->nvals; wi->done++) {
+		val = wi->data[wi->done];
+		if (wi->mask != 0xffffffffffffffff) {
+			if (rdmsrl_safe(wi->reg, &cur)) {
+				wi->err = -EIO;
+				break;
+			}
+			val = (cur & ~wi->mask) | (val & wi->mask);
+		}
+		if (msr_vreg_wrmsrl_safe(wi->reg, val)) {
+			wi->err = -EIO;
+			break;
+		}
+	}
+}
+
 static ssize_t msr_write(struct file *file, const char __user *buf,
 			 size_t count, loff_t *ppos)
 {
-	const u32 __user *tmp = (const u32 __user *)buf;
-	u32 curdata[2];
-	u32 data[2];
 	u32 reg = *ppos;
 	u64 mask;
 	int cpu = iminor(file->f_path.dentry->d_inode);
 	int err = 0;
 	ssize_t bytes = 0;
 	struct msr_session_info *myinfo = file->private_data;
+	struct msr_write_info *wi;
 
 	if (count % 8)
 		return -EINVAL;	/* Invalid chunk size */
@@ -137,30 +258,32 @@ static ssize_t msr_write(struct file *file, const char __user *buf,
 	if (!myinfo->rawio_allowed && mask == 0)
 		return -EACCES;
 
-	for (; count; count -= 8) {
-		if (copy_from_user(&data, tmp, 8)) {
-			err = -EFAULT;
-			break;
-		}
+	if (MSR_SAFE_IS_VIRT(reg))
+		return -EACCES;	/* Virtual MSRs are read-only */
 
-		if (mask != 0xffffffffffffffff) {
-			err = rdmsr_safe_on_cpu(cpu, reg,
-						&curdata[0], &curdata[1]);
-			if (err)
-				break;
+	wi = kmalloc(sizeof(*wi), GFP_KERNEL);
+	if (!wi)
+		return -ENOMEM;
 
-			*(u64 *)&curdata[0] &= ~mask;
-			*(u64 *)&data[0] &= mask;
-			*(u64 *)&data[0] |= *(u64 *)&curdata[0];
+	wi->reg = reg;
+	wi->mask = mask;
+	while (count && !err) {
+		wi->nvals = min_t(size_t, count / 8, MSR_WRITE_MAX_VALS);
+		if (copy_from_user(wi->data, buf + bytes, wi->nvals * 8)) {
+			err = -EFAULT;
+			break;
 		}
 
-		err = wrmsr_safe_on_cpu(cpu, reg, data[0], data[1]);
+		err = smp_call_function_single(cpu, __msr_write_regs, wi, 1);
 		if (err)
 			break;
-		tmp += 2;
-		bytes += 8;
+
+		bytes += wi->done * 8;
+		count -= wi->done * 8;
+		err = wi->err;
 	}
 
+	kfree(wi);
 	return bytes ? bytes : err;
 }
 
@@ -168,10 +291,25 @@ static long msr_ioctl(struct file *file, unsigned int ioc, unsigned long arg)
 {
 	u32 __user *uregs = (u32 __user *)arg;
 	u32 regs[8];
+	u32 mode;
 	int cpu = iminor(file->f_path.dentry->d_inode);
+	struct msr_session_info *myinfo = file->private_data;
 	int err;
 
 	switch (ioc) {
+	case X86_IOC_MSR_SAFE_SET_MODE:
+		if (get_user(mode, uregs)) {
+			err = -EFAULT;
+			break;
+		}
+		if (mode & ~MSR_SAFE_MODE_CONSECUTIVE) {
+			err = -EINVAL;
+			break;
+		}
+		myinfo->mode = mode;
+		err = 0;
+		break;
+
 	case X86_IOC_RDMSR_REGS:
 		if (!(file->f_mode & FMODE_READ)) {
 			err = -EBADF;
@@ -230,6 +368,7 @@ static int msr_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	myinfo->rawio_allowed = capable(CAP_SYS_RAWIO);
+	myinfo->mode = 0;
 	file->private_data = myinfo;
 
 	return 0;
@@ -312,10 +451,15 @@ static int __init msr_init(void)
 		pr_err("failed to initialize msrbatch\n");
 		goto out;
 	}
+	err = msrsampler_init();
+	if (err != 0) {
+		pr_err("failed to initialize msrsampler\n");
+		goto out_batch;
+	}
 	err = msr_whitelist_init();
 	if (err != 0) {
 		pr_err("failed to initialize whitelist for msr\n");
-		goto out_batch;
+		goto out_sampler;
 	}
 	majordev = __register_chrdev(0, 0, num_possible_cpus(),
 					  "cpu/msr_safe", &msr_fops);
@@ -350,6 +494,9 @@ out_chrdev:
 	__unregister_chrdev(majordev, 0, num_possible_cpus(), "cpu/msr_safe");
 out_wlist:
 	msr_whitelist_cleanup();
+	msr_vreg_cleanup();
+out_sampler:
+	msrsampler_cleanup();
 out_batch:
 	msrbatch_cleanup();
 out:
@@ -366,6 +513,8 @@ static void __exit msr_exit(void)
 	__unregister_chrdev(majordev, 0, num_possible_cpus(), "cpu/msr_safe");
 	unregister_hotcpu_notifier(&msr_class_cpu_notifier);
 	msr_whitelist_cleanup();
+	msr_vreg_cleanup();
+	msrsampler_cleanup();
 	msrbatch_cleanup();
 }
 
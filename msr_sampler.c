@@ -0,0 +1,497 @@
+/*
+ * x86 MSR periodic sampler device
+ *
+ * This device is configured by ioctl() with a list of rdmsr ops and a
+ * period.  A pinned hrtimer on each target CPU executes that CPU's ops
+ * locally, so no sample needs a syscall or a cross-CPU IPI, and appends
+ * a timestamped record to a per-CPU ring that userspace maps with mmap().
+ *
+ * This driver uses /dev/cpu/msr_sampler as its device file.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/cpu.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/topology.h>
+#include <linux/module.h>
+#include <asm/msr.h>
+#include "msr_whitelist.h"
+#include "msr_sampler.h"
+#include "msr_vreg.h"
+#include "msr.h"
+
+#define MSR_SAMPLER_MIN_PERIOD_NS 10000	/* Keep ticks from starving a CPU */
+
+static int majordev;
+static struct class *cdev_class;
+static char cdev_created;
+static char cdev_registered;
+static char cdev_class_created;
+
+/*
+ * State of one sampled CPU.  Only the tick on that CPU touches head and
+ * the ring contents once the timer is started.
+ */
+struct msrsampler_cpu {
+	struct hrtimer timer;
+	int cpu;
+	u32 numops;
+	u32 *msrs;			/* Array[numops] MSRs to read */
+	u64 head;			/* Kernel copy of ring->head */
+	ktime_t period;
+	u64 generation;			/* Whitelist generation checked against */
+	struct msr_sampler_ring *ring;	/* vmalloc_user, mapped read-only */
+};
+
+struct msrsampler_session_info {
+	int rawio_allowed;
+	struct mutex lock;		/* Protects everything below */
+	int running;
+	unsigned long ring_size;	/* Page-aligned mmap stride per CPU */
+	struct msrsampler_cpu **cpus;	/* Array[nr_cpu_ids], NULL if unused */
+};
+
+static enum hrtimer_restart msrsampler_tick(struct hrtimer *timer)
+{
+	struct msrsampler_cpu *sc =
+			container_of(timer, struct msrsampler_cpu, timer);
+	struct msr_sampler_ring *ring = sc->ring;
+	struct msr_sampler_record *rec;
+	u32 i;
+
+	if (smp_processor_id() != sc->cpu ||
+			sc->generation != msr_whitelist_generation()) {
+		WRITE_ONCE(ring->flags, ring->flags | MSR_SAMPLER_STOPPED);
+		return HRTIMER_NORESTART;
+	}
+
+	rec = (struct msr_sampler_record *)((char *)ring + ring->data_offset +
+			(sc->head % ring->nrecords) * ring->record_size);
+	rec->timestamp = ktime_to_ns(ktime_get());
+	for (i = 0; i < sc->numops; i++) {
+		if (msr_vreg_rdmsrl_safe(sc->msrs[i], &rec->msrdata[i])) {
+			rec->msrdata[i] = 0;
+			WRITE_ONCE(ring->errors, ring->errors + 1);
+		}
+	}
+
+	/* Publish the record before the head that covers it */
+	smp_wmb();
+	WRITE_ONCE(ring->head, ++sc->head);
+
+	hrtimer_forward_now(timer, sc->period);
+	return HRTIMER_RESTART;
+}
+
+/* Runs on sc->cpu so that the pinned timer stays on that CPU */
+static void msrsampler_start_cpu(void *info)
+{
+	struct msrsampler_cpu *sc = info;
+
+	hrtimer_start(&sc->timer, sc->period, HRTIMER_MODE_REL_PINNED);
+}
+
+static void msrsampler_stop(struct msrsampler_session_info *myinfo)
+{
+	int cpu;
+
+	if (!myinfo->running)
+		return;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		if (myinfo->cpus[cpu])
+			hrtimer_cancel(&myinfo->cpus[cpu]->timer);
+	myinfo->running = 0;
+}
+
+/* Rings are kept after a stop so the last records can still be mapped */
+static void msrsampler_free(struct msrsampler_session_info *myinfo)
+{
+	int cpu;
+
+	msrsampler_stop(myinfo);
+	if (!myinfo->cpus)
+		return;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		if (!myinfo->cpus[cpu])
+			continue;
+		vfree(myinfo->cpus[cpu]->ring);
+		kfree(myinfo->cpus[cpu]->msrs);
+		kfree(myinfo->cpus[cpu]);
+	}
+	kfree(myinfo->cpus);
+	myinfo->cpus = NULL;
+	myinfo->ring_size = 0;
+}
+
+static int msrsampler_open(struct inode *inode, struct file *file)
+{
+	struct msrsampler_session_info *myinfo;
+
+	myinfo = kzalloc(sizeof(*myinfo), GFP_KERNEL);
+	if (!myinfo)
+		return -ENOMEM;
+
+	myinfo->rawio_allowed = capable(CAP_SYS_RAWIO);
+	mutex_init(&myinfo->lock);
+	file->private_data = myinfo;
+
+	return 0;
+}
+
+static int msrsampler_close(struct inode *inode, struct file *file)
+{
+	struct msrsampler_session_info *myinfo = file->private_data;
+
+	msrsampler_free(myinfo);
+	kfree(myinfo);
+	file->private_data = 0;
+	return 0;
+}
+
+static int msrsampler_apply_whitelist(struct msr_batch_op *ops, u32 numops,
+				struct msrsampler_session_info *myinfo)
+{
+	struct msr_batch_op *op;
+	int err = 0;
+
+	for (op = ops; op < ops + numops; ++op) {
+		op->err = 0;
+
+		if (op->cpu >= nr_cpu_ids || !cpu_online(op->cpu)) {
+			pr_err("No such CPU %d\n", op->cpu);
+			op->err = err = -ENXIO;
+			continue;
+		}
+
+		if (!op->isrdmsr) {
+			pr_err("Sampler op for MSR %x is not a read\n",
+								op->msr);
+			op->err = err = -EINVAL;
+			continue;
+		}
+
+		if (!myinfo->rawio_allowed &&
+					!msr_whitelist_maskexists(op->msr)) {
+			pr_err("No whitelist entry for MSR %x\n", op->msr);
+			op->err = err = -EACCES;
+		}
+	}
+	return err;
+}
+
+/*
+ * Build one msrsampler_cpu per CPU named in ops, with every ring laid out
+ * the same size so that a CPU's ring lives at mmap offset cpu * ring_size.
+ */
+static int msrsampler_build(struct msrsampler_session_info *myinfo,
+			struct msr_batch_op *ops, u32 numops, u32 nrecords,
+			u64 period_ns, u64 generation)
+{
+	struct msrsampler_cpu *sc;
+	struct msr_sampler_ring *ring;
+	u32 *counts;
+	u32 maxops = 0;
+	unsigned long data_offset = ALIGN(sizeof(*ring), L1_CACHE_BYTES);
+	unsigned long record_size;
+	int cpu;
+	u32 i;
+	int err = -ENOMEM;
+
+	counts = kcalloc(nr_cpu_ids, sizeof(*counts), GFP_KERNEL);
+	myinfo->cpus = kcalloc(nr_cpu_ids, sizeof(*myinfo->cpus), GFP_KERNEL);
+	if (!counts || !myinfo->cpus)
+		goto out;
+
+	for (i = 0; i < numops; i++)
+		maxops = max(maxops, ++counts[ops[i].cpu]);
+
+	if (maxops > MSR_SAMPLER_MAX_CPU_OPS) {
+		pr_err("%u sampler ops on one CPU exceed %u\n", maxops,
+						MSR_SAMPLER_MAX_CPU_OPS);
+		err = -E2BIG;
+		goto out;
+	}
+	if (period_ns < (u64)maxops * MSR_SAMPLER_OP_NS) {
+		pr_err("Sampler period %llu ns is too short for %u ops\n",
+							period_ns, maxops);
+		err = -EINVAL;
+		goto out;
+	}
+
+	record_size = sizeof(struct msr_sampler_record) + maxops * sizeof(u64);
+	if (nrecords > (MSR_SAMPLER_MAX_RING_SIZE - data_offset) /
+								record_size) {
+		pr_err("Sampler ring of %u records exceeds %u bytes\n",
+					nrecords, MSR_SAMPLER_MAX_RING_SIZE);
+		err = -E2BIG;
+		goto out;
+	}
+	myinfo->ring_size = PAGE_ALIGN(data_offset + nrecords * record_size);
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		if (!counts[cpu])
+			continue;
+
+		sc = kzalloc_node(sizeof(*sc), GFP_KERNEL, cpu_to_node(cpu));
+		if (!sc)
+			goto out;
+		myinfo->cpus[cpu] = sc;
+
+		sc->msrs = kmalloc_node(counts[cpu] * sizeof(*sc->msrs),
+					GFP_KERNEL, cpu_to_node(cpu));
+		sc->ring = vmalloc_user(myinfo->ring_size);
+		if (!sc->msrs || !sc->ring)
+			goto out;
+
+		sc->cpu = cpu;
+		sc->period = ns_to_ktime(period_ns);
+		sc->generation = generation;
+		hrtimer_init(&sc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		sc->timer.function = msrsampler_tick;
+
+		ring = sc->ring;
+		ring->cpu = cpu;
+		ring->numops = counts[cpu];
+		ring->nrecords = nrecords;
+		ring->record_size = record_size;
+		ring->data_offset = data_offset;
+	}
+
+	for (i = 0; i < numops; i++) {
+		sc = myinfo->cpus[ops[i].cpu];
+		sc->msrs[sc->numops++] = ops[i].msr;
+	}
+
+	err = 0;
+out:
+	kfree(counts);
+	return err;
+}
+
+static long msrsampler_ioctl_start(struct msrsampler_session_info *myinfo,
+				struct msr_sampler_config __user *ucfg)
+{
+	int err = 0;
+	int cpu;
+	u64 generation;
+	struct msr_sampler_config kcfg;
+	struct msr_batch_op *ops;
+
+	if (copy_from_user(&kcfg, ucfg, sizeof(kcfg))) {
+		pr_err("Copy of sampler config failed\n");
+		return -EFAULT;
+	}
+
+	if (kcfg.numops <= 0 || kcfg.nrecords <= 0) {
+		pr_err("Invalid # of ops %u or records %u\n",
+						kcfg.numops, kcfg.nrecords);
+		return -EINVAL;
+	}
+
+	if (kcfg.numops > MSR_SAMPLER_MAX_CPU_OPS * nr_cpu_ids) {
+		pr_err("%u sampler ops exceed %u per CPU\n", kcfg.numops,
+						MSR_SAMPLER_MAX_CPU_OPS);
+		return -E2BIG;
+	}
+
+	if (kcfg.period_ns < MSR_SAMPLER_MIN_PERIOD_NS) {
+		pr_err("Sampler period %llu ns is too short\n", kcfg.period_ns);
+		return -EINVAL;
+	}
+
+	ops = kmalloc_array(kcfg.numops, sizeof(*ops), GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+
+	if (copy_from_user(ops, kcfg.ops, kcfg.numops * sizeof(*ops))) {
+		pr_err("Copy of sampler ops failed\n");
+		err = -EFAULT;
+		goto out_freeops;
+	}
+
+	mutex_lock(&myinfo->lock);
+	if (myinfo->running) {
+		err = -EBUSY;
+		goto out_unlock;
+	}
+
+	generation = msr_whitelist_generation();
+	err = msrsampler_apply_whitelist(ops, kcfg.numops, myinfo);
+	if (err) {
+		pr_err("Failed to apply whitelist %d\n", err);
+		if (copy_to_user(kcfg.ops, ops, kcfg.numops * sizeof(*ops)))
+			pr_err("copy sampler ops back to user failed\n");
+		goto out_unlock;
+	}
+
+	msrsampler_free(myinfo);
+	err = msrsampler_build(myinfo, ops, kcfg.numops, kcfg.nrecords,
+						kcfg.period_ns, generation);
+	if (err) {
+		msrsampler_free(myinfo);
+		goto out_unlock;
+	}
+
+	kcfg.ring_size = myinfo->ring_size;
+	if (copy_to_user(ucfg, &kcfg, sizeof(kcfg))) {
+		msrsampler_free(myinfo);
+		err = -EFAULT;
+		goto out_unlock;
+	}
+
+	myinfo->running = 1;
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		if (!myinfo->cpus[cpu])
+			continue;
+		err = smp_call_function_single(cpu, msrsampler_start_cpu,
+						myinfo->cpus[cpu], 1);
+		if (err) {
+			pr_err("Failed to start sampling on cpu %d: %d\n",
+								cpu, err);
+			/* Stops the CPUs already started */
+			msrsampler_free(myinfo);
+			break;
+		}
+	}
+
+out_unlock:
+	mutex_unlock(&myinfo->lock);
+out_freeops:
+	kfree(ops);
+	return err;
+}
+
+static long msrsampler_ioctl(struct file *f, unsigned int ioc,
+						unsigned long arg)
+{
+	struct msrsampler_session_info *myinfo = f->private_data;
+
+	if (!(f->f_mode & FMODE_READ)) {
+		pr_err("File not open for reading\n");
+		return -EBADF;
+	}
+
+	switch (ioc) {
+	case X86_IOC_MSR_SAMPLER_START:
+		return msrsampler_ioctl_start(myinfo, (void __user *)arg);
+	case X86_IOC_MSR_SAMPLER_STOP:
+		mutex_lock(&myinfo->lock);
+		msrsampler_stop(myinfo);
+		mutex_unlock(&myinfo->lock);
+		return 0;
+	default:
+		pr_err("Invalid ioctl op %u\n", ioc);
+		return -ENOTTY;
+	}
+}
+
+static int msrsampler_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct msrsampler_session_info *myinfo = f->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long stride;
+	unsigned long cpu;
+	int err = -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	mutex_lock(&myinfo->lock);
+	if (!myinfo->cpus)
+		goto out_unlock;
+
+	stride = myinfo->ring_size >> PAGE_SHIFT;
+	cpu = vma->vm_pgoff / stride;
+	if (vma->vm_pgoff % stride || cpu >= nr_cpu_ids ||
+			!myinfo->cpus[cpu] || size > myinfo->ring_size)
+		goto out_unlock;
+
+	err = remap_vmalloc_range(vma, myinfo->cpus[cpu]->ring, 0);
+
+out_unlock:
+	mutex_unlock(&myinfo->lock);
+	return err;
+}
+
+static const struct file_operations fops = {
+	.owner = THIS_MODULE,
+	.open = msrsampler_open,
+	.unlocked_ioctl = msrsampler_ioctl,
+	.compat_ioctl = msrsampler_ioctl,
+	.mmap = msrsampler_mmap,
+	.release = msrsampler_close
+};
+
+void msrsampler_cleanup(void)
+{
+	if (cdev_created) {
+		cdev_created = 0;
+		device_destroy(cdev_class, MKDEV(majordev, 0));
+	}
+
+	if (cdev_class_created) {
+		cdev_class_created = 0;
+		class_destroy(cdev_class);
+	}
+
+	if (cdev_registered) {
+		cdev_registered = 0;
+		unregister_chrdev(majordev, "cpu/msr_sampler");
+	}
+}
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,39)
+static char *msrsampler_nodename(struct device *dev, mode_t *mode)
+#else
+static char *msrsampler_nodename(struct device *dev, umode_t *mode)
+#endif
+{
+	return kasprintf(GFP_KERNEL, "cpu/msr_sampler");
+}
+
+int msrsampler_init(void)
+{
+	int err;
+	struct device *dev;
+
+	majordev = register_chrdev(0, "cpu/msr_sampler", &fops);
+	if (majordev < 0) {
+		pr_err("msrsampler_init: unable to register chrdev\n");
+		msrsampler_cleanup();
+		return -EBUSY;
+	}
+	cdev_registered = 1;
+
+	cdev_class = class_create(THIS_MODULE, "msr_sampler");
+	if (IS_ERR(cdev_class)) {
+		err = PTR_ERR(cdev_class);
+		msrsampler_cleanup();
+		return err;
+	}
+	cdev_class_created = 1;
+
+	cdev_class->devnode = msrsampler_nodename;
+
+	dev = device_create(cdev_class, NULL, MKDEV(majordev, 0),
+						NULL, "msr_sampler");
+	if (IS_ERR(dev)) {
+		err = PTR_ERR(dev);
+		msrsampler_cleanup();
+		return err;
+	}
+	cdev_created = 1;
+	return 0;
+}
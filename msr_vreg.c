@@ -0,0 +1,424 @@
+/*
+ * Virtual MSRs maintained by msr-safe
+ *
+ * A counter declared in the whitelist with width=N is also readable at
+ * MSR_SAFE_ACCUM(msr) as a 64-bit count that keeps counting across wraps
+ * of the N-bit hardware counter.  Each CPU keeps its own accumulators, and
+ * a delayed work refreshes all of them every refresh_ms so that no wrap is
+ * missed however rarely userspace samples.  A read refreshes the
+ * accumulator it returns, so values are always current.  A table
+ * configured on demand, such as the built-in whitelist's, costs no IPIs
+ * until a virtual MSR is first read; refreshing then starts and goes on
+ * for as long as the table is installed.
+ *
+ * Each refresh also snapshots the accumulators.  Derived registers in the
+ * MSR_SAFE_DERIVED range are evaluated from the last two snapshots, so all
+ * readers see the same value for the same interval and none of them needs
+ * to keep state of its own.  They read as 0 until two refreshes have run.
+ *
+ * Accumulators assume the counter only counts up between writes.  Writes
+ * through msr-safe go through msr_vreg_wrmsrl_safe(), which brings the
+ * accumulator up to date and has it continue from the value written, so
+ * a write is not mistaken for a wrap.  Writes by anything else are.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/smp.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <asm/msr.h>
+#include "msr_vreg.h"
+#include "msr.h"
+
+static unsigned int refresh_ms = 1000;
+module_param(refresh_ms, uint, 0644);
+MODULE_PARM_DESC(refresh_ms, "Period (ms) at which virtual counters are extended");
+
+struct msr_vreg_accum {
+	u64 last;	/* Last raw value read */
+	u64 total;	/* Extended count */
+	u64 snap[2];	/* total at the last two refreshes, [1] newest */
+	int primed;	/* last and total are valid */
+};
+
+struct msr_vreg_cpu {
+	u64 stamp[2];	/* Time (ns) of the last two refreshes, [1] newest */
+	int nsnap;	/* # of valid snapshots, 0-2 */
+	struct msr_vreg_accum accum[0];	/* One per counter */
+};
+
+struct msr_vreg_table {
+	int ncounters;
+	struct msr_vreg_counter *counters;	/* Sorted by msr */
+	int nderived;
+	struct msr_vreg_derived *derived;	/* Sorted by msr */
+	int (*input)[2];			/* Counter index of derived in[] */
+	void __percpu *cpu;			/* struct msr_vreg_cpu */
+	int idle;				/* Not refreshed until first read */
+};
+
+/* Dereferenced with interrupts off on the CPU whose accumulators it reads */
+static struct msr_vreg_table __rcu *vreg_table;
+static DEFINE_MUTEX(vreg_mutex);
+
+static void msr_vreg_refresh(struct work_struct *work);
+static DECLARE_DELAYED_WORK(vreg_work, msr_vreg_refresh);
+
+static int cmp_counter(const void *a, const void *b)
+{
+	const struct msr_vreg_counter *ca = a;
+	const struct msr_vreg_counter *cb = b;
+
+	return ca->msr < cb->msr ? -1 : ca->msr > cb->msr;
+}
+
+static int cmp_derived(const void *a, const void *b)
+{
+	const struct msr_vreg_derived *da = a;
+	const struct msr_vreg_derived *db = b;
+
+	return da->msr < db->msr ? -1 : da->msr > db->msr;
+}
+
+static int ninputs(const struct msr_vreg_derived *d)
+{
+	return d->op == MSR_VREG_RATIO ? 2 : 1;
+}
+
+static u64 counter_mask(const struct msr_vreg_counter *c)
+{
+	return c->width < 64 ? (1ULL << c->width) - 1 : ~0ULL;
+}
+
+static int update_accum(const struct msr_vreg_counter *c,
+					struct msr_vreg_accum *a)
+{
+	u64 mask = counter_mask(c);
+	u64 raw;
+
+	if (rdmsrl_safe(c->msr, &raw))
+		return -EIO;
+
+	raw &= mask;
+	if (a->primed)
+		a->total += (raw - a->last) & mask;
+	else
+		a->total = raw;
+	a->last = raw;
+	a->primed = 1;
+	return 0;
+}
+
+static void __msr_vreg_refresh(void *info)
+{
+	struct msr_vreg_table *t = rcu_dereference_sched(vreg_table);
+	struct msr_vreg_cpu *vc;
+	struct msr_vreg_accum *a;
+	int i;
+
+	if (!t)
+		return;
+
+	vc = this_cpu_ptr(t->cpu);
+	for (i = 0; i < t->ncounters; i++) {
+		a = &vc->accum[i];
+		update_accum(&t->counters[i], a);
+		a->snap[0] = a->snap[1];
+		a->snap[1] = a->total;
+	}
+	vc->stamp[0] = vc->stamp[1];
+	vc->stamp[1] = ktime_to_ns(ktime_get());
+	if (vc->nsnap < 2)
+		vc->nsnap++;
+}
+
+static void msr_vreg_refresh(struct work_struct *work)
+{
+	struct msr_vreg_table *t;
+
+	on_each_cpu(__msr_vreg_refresh, NULL, 1);
+
+	rcu_read_lock_sched();
+	t = rcu_dereference_sched(vreg_table);
+	if (t && !READ_ONCE(t->idle))
+		schedule_delayed_work(&vreg_work,
+				msecs_to_jiffies(max(refresh_ms, 1U)));
+	rcu_read_unlock_sched();
+}
+
+static void free_table(struct msr_vreg_table *t)
+{
+	if (!t)
+		return;
+
+	free_percpu(t->cpu);
+	kfree(t->input);
+	kfree(t->derived);
+	kfree(t->counters);
+	kfree(t);
+}
+
+static struct msr_vreg_counter *find_counter(struct msr_vreg_table *t,
+								u32 msr)
+{
+	struct msr_vreg_counter key = { .msr = msr };
+
+	return bsearch(&key, t->counters, t->ncounters, sizeof(key),
+								cmp_counter);
+}
+
+/*
+ * Counters tracked by the table are the declared ones plus every input of
+ * a derived register, which is treated as 64 bits wide unless declared.
+ */
+static int build_counters(struct msr_vreg_table *t,
+		const struct msr_vreg_counter *counters, int ncounters,
+		const struct msr_vreg_derived *derived, int nderived)
+{
+	struct msr_vreg_counter *c;
+	int i;
+	int j;
+	int n;
+
+	c = kmalloc_array(ncounters + 2 * nderived, sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	memcpy(c, counters, ncounters * sizeof(*c));
+	for (i = 0, n = ncounters; i < nderived; i++) {
+		for (j = 0; j < ninputs(&derived[i]); j++) {
+			c[n].msr = derived[i].in[j];
+			c[n].width = 64;
+			n++;
+		}
+	}
+	sort(c, n, sizeof(*c), cmp_counter, NULL);
+
+	/* Merge duplicates, keeping the narrowest declared width */
+	for (i = 0, j = 0; i < n; i++) {
+		if (j && c[j - 1].msr == c[i].msr) {
+			c[j - 1].width = min(c[j - 1].width, c[i].width);
+			continue;
+		}
+		c[j++] = c[i];
+	}
+	t->counters = c;
+	t->ncounters = j;
+	return 0;
+}
+
+/*
+ * Replace the set of extended counters and derived registers.  Accumulators
+ * start over from the current hardware value and derived registers read 0
+ * until two refreshes have run; no counters and no derived registers turns
+ * virtual MSRs off.  If on_demand is set, refreshing waits for the first
+ * read of a virtual MSR.
+ */
+int msr_vreg_configure(const struct msr_vreg_counter *counters, int ncounters,
+		const struct msr_vreg_derived *derived, int nderived,
+		bool on_demand)
+{
+	struct msr_vreg_table *t = NULL;
+	struct msr_vreg_table *old;
+	int i;
+	int j;
+
+	if (ncounters || nderived) {
+		t = kzalloc(sizeof(*t), GFP_KERNEL);
+		if (!t)
+			return -ENOMEM;
+		t->idle = on_demand;
+
+		if (build_counters(t, counters, ncounters, derived, nderived))
+			goto out_nomem;
+
+		t->nderived = nderived;
+		if (nderived) {
+			t->derived = kmemdup(derived,
+					nderived * sizeof(*derived), GFP_KERNEL);
+			t->input = kcalloc(nderived, sizeof(*t->input),
+								GFP_KERNEL);
+			if (!t->derived || !t->input)
+				goto out_nomem;
+			sort(t->derived, nderived, sizeof(*derived),
+							cmp_derived, NULL);
+		}
+		for (i = 0; i < nderived; i++)
+			for (j = 0; j < ninputs(&t->derived[i]); j++)
+				t->input[i][j] = find_counter(t,
+					t->derived[i].in[j]) - t->counters;
+
+		t->cpu = __alloc_percpu(sizeof(struct msr_vreg_cpu) +
+				t->ncounters * sizeof(struct msr_vreg_accum),
+				__alignof__(struct msr_vreg_cpu));
+		if (!t->cpu)
+			goto out_nomem;
+	}
+
+	mutex_lock(&vreg_mutex);
+	old = rcu_dereference_protected(vreg_table,
+					lockdep_is_held(&vreg_mutex));
+	rcu_assign_pointer(vreg_table, t);
+	if (t && !on_demand)
+		mod_delayed_work(system_wq, &vreg_work, 0);
+	mutex_unlock(&vreg_mutex);
+
+	/* IPI handlers run with interrupts off, which holds off sched-RCU */
+	synchronize_sched();
+	free_table(old);
+
+	return 0;
+
+out_nomem:
+	free_table(t);
+	return -ENOMEM;
+}
+
+/* x * mul / div without overflowing as long as div * mul fits in 64 bits */
+static u64 mul_div(u64 x, u64 mul, u64 div)
+{
+	u64 q = div64_u64(x, div);
+	u64 r = x - q * div;
+
+	return q * mul + div64_u64(r * mul, div);
+}
+
+static u64 eval_derived(struct msr_vreg_table *t, struct msr_vreg_cpu *vc,
+						struct msr_vreg_derived *d)
+{
+	int *input = t->input[d - t->derived];
+	struct msr_vreg_accum *a = &vc->accum[input[0]];
+	u64 da;
+	u64 db;
+
+	if (vc->nsnap < 2)
+		return 0;
+
+	da = a->snap[1] - a->snap[0];
+	switch (d->op) {
+	case MSR_VREG_DELTA:
+		return da * d->scale;
+	case MSR_VREG_RATE:
+		db = vc->stamp[1] - vc->stamp[0];
+		return db ? mul_div(da * d->scale, NSEC_PER_SEC, db) : 0;
+	case MSR_VREG_RATIO:
+		a = &vc->accum[input[1]];
+		db = a->snap[1] - a->snap[0];
+		return db ? mul_div(da, d->scale, db) : 0;
+	}
+	return 0;
+}
+
+/*
+ * Read a real or virtual MSR on the current CPU.  Must be called with
+ * interrupts disabled, as in an IPI or timer handler.
+ */
+int msr_vreg_rdmsrl_safe(u32 msr, u64 *val)
+{
+	struct msr_vreg_table *t;
+	struct msr_vreg_counter *c;
+	struct msr_vreg_derived key;
+	struct msr_vreg_derived *d;
+	struct msr_vreg_cpu *vc;
+	struct msr_vreg_accum *accum;
+	int err;
+
+	if (!MSR_SAFE_IS_VIRT(msr))
+		return rdmsrl_safe(msr, val) ? -EIO : 0;
+
+	t = rcu_dereference_sched(vreg_table);
+	if (!t)
+		return -EIO;
+	vc = this_cpu_ptr(t->cpu);
+
+	/* mod_delayed_work() is safe with interrupts off */
+	if (READ_ONCE(t->idle) && xchg(&t->idle, 0))
+		mod_delayed_work(system_wq, &vreg_work, 0);
+
+	if (MSR_SAFE_IS_DERIVED(msr)) {
+		key.msr = msr;
+		d = bsearch(&key, t->derived, t->nderived, sizeof(key),
+								cmp_derived);
+		if (!d)
+			return -EIO;
+		*val = eval_derived(t, vc, d);
+		return 0;
+	}
+
+	c = find_counter(t, msr & ~MSR_SAFE_VIRT_BASE);
+	if (!c)
+		return -EIO;
+
+	accum = &vc->accum[c - t->counters];
+	err = update_accum(c, accum);
+	if (!err)
+		*val = accum->total;
+	return err;
+}
+
+/*
+ * Write a hardware MSR on the current CPU.  If it is an extended counter,
+ * its accumulator first takes in the counts up to the write and then
+ * continues from the value written.  Must be called with interrupts
+ * disabled.
+ */
+int msr_vreg_wrmsrl_safe(u32 msr, u64 val)
+{
+	struct msr_vreg_table *t = rcu_dereference_sched(vreg_table);
+	struct msr_vreg_counter *c = t ? find_counter(t, msr) : NULL;
+	struct msr_vreg_cpu *vc;
+	struct msr_vreg_accum *a = NULL;
+
+	if (c) {
+		vc = this_cpu_ptr(t->cpu);
+		a = &vc->accum[c - t->counters];
+		update_accum(c, a);
+	}
+	if (wrmsrl_safe(msr, val))
+		return -EIO;
+	if (a && a->primed)
+		a->last = val & counter_mask(c);
+	return 0;
+}
+
+struct msr_vreg_read_info {
+	u32 msr;
+	int err;
+	u64 val;
+};
+
+static void __msr_vreg_read(void *info)
+{
+	struct msr_vreg_read_info *ri = info;
+
+	ri->err = msr_vreg_rdmsrl_safe(ri->msr, &ri->val);
+}
+
+int msr_vreg_rdmsrl_safe_on_cpu(unsigned int cpu, u32 msr, u64 *val)
+{
+	struct msr_vreg_read_info ri = { .msr = msr };
+	int err;
+
+	err = smp_call_function_single(cpu, __msr_vreg_read, &ri, 1);
+	if (!err)
+		err = ri.err;
+	if (!err)
+		*val = ri.val;
+	return err;
+}
+
+void msr_vreg_cleanup(void)
+{
+	msr_vreg_configure(NULL, 0, NULL, 0, false);
+	cancel_delayed_work_sync(&vreg_work);
+}
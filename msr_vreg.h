@@ -0,0 +1,36 @@
+/*
+ * Internal declarations for the virtual MSRs maintained by msr-safe.
+ */
+#ifndef _ARCH_X68_KERNEL_MSR_VREG_H
+#define _ARCH_X68_KERNEL_MSR_VREG_H 1
+
+#include <linux/types.h>
+
+struct msr_vreg_counter {
+	u32 msr;	/* Hardware counter to extend */
+	u32 width;	/* # of implemented bits, 1-64 */
+};
+
+enum msr_vreg_op {
+	MSR_VREG_NONE = 0,
+	MSR_VREG_DELTA,		/* scale * d(in[0]) */
+	MSR_VREG_RATE,		/* scale * d(in[0]) per second */
+	MSR_VREG_RATIO,		/* scale * d(in[0]) / d(in[1]) */
+};
+
+struct msr_vreg_derived {
+	u32 msr;	/* Address in the MSR_SAFE_DERIVED range */
+	u32 op;		/* enum msr_vreg_op */
+	u32 in[2];	/* Hardware counters the value is derived from */
+	u64 scale;	/* Multiplier applied before any division */
+};
+
+void msr_vreg_cleanup(void);
+int msr_vreg_configure(const struct msr_vreg_counter *counters, int ncounters,
+		const struct msr_vreg_derived *derived, int nderived,
+		bool on_demand);
+int msr_vreg_rdmsrl_safe(u32 msr, u64 *val);
+int msr_vreg_rdmsrl_safe_on_cpu(unsigned int cpu, u32 msr, u64 *val);
+int msr_vreg_wrmsrl_safe(u32 msr, u64 val);
+
+#endif /* _ARCH_X68_KERNEL_MSR_VREG_H */
@@ -32,261 +32,1660 @@
 
 #include <linux/kernel.h>
 #include <linux/version.h>
-#include <linux/hashtable.h>
 #include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/ctype.h>
 #include <linux/device.h>
+#include <linux/atomic.h>
+#include <linux/rcupdate.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <asm/processor.h>
+#include "msr_wlindex.h"
+#include "msr_vreg.h"
+#include "msr_whitelist.h"
+#include "msr.h"
 
-#define MAX_WLIST_BSIZE ((128 * 1024) + 1) /* "+1" for null character */
+#define MAX_WLIST_LINE 4096	/* Longest text line of an upload */
+#define WLIST_CHUNK 4096	/* Bytes copied from user space at a time */
+#define MIN_WLIST_COMPACT 64	/* Edits an edit table may always hold */
+#define VIRT_LAST (MSR_SAFE_VIRT_BASE | 0x1fffffffu)
 
 struct whitelist_entry {
 	u64 wmask;	/* Bits that may be written */
-	u64 msr;	/* Address of msr (used as hash key) */
-	u64 *msrdata;	/* ptr to original msr contents of writable bits */
-	struct hlist_node hlist;
+	u64 msr;	/* Address of msr, or first of a range */
+	u64 last;	/* Last msr of a range, else msr */
+	u32 width;	/* Counter width if extended by msr_vreg, else 0 */
+	u32 scope;	/* MSR_WHITELIST_THREAD etc., only reported */
+	struct msr_vreg_derived derived; /* Derived register, op 0 if none */
+};
+
+/*
+ * A whitelist is never changed once published; writers build a new one and
+ * swap the pointer, so readers need only rcu_read_lock().
+ *
+ * An edit ("+entry" and "-msr" lines) does not copy the whole whitelist.
+ * It publishes an edit table, whose entries are the additions and whose
+ * base is the full table being edited, with the slots of the base entries
+ * that were removed.  Further edits replace the edit table and share the
+ * base, until the edit table grows past an eighth of its base and the two
+ * are merged into a new full table.
+ */
+struct whitelist_table {
+	int numentries;
+	struct whitelist_entry *entries;	/* In input order */
+	struct msr_wlindex idx;			/* Slots index entries[] */
+	struct whitelist_table *base;		/* Table edited, or NULL */
+	int nremoved;
+	u32 *removed;				/* Sorted base slots removed */
+	bool builtin;				/* Virtual MSRs start on demand */
+};
+
+struct whitelist_key {
+	u32 msr;
+	u32 slot;
+};
+
+enum whitelist_upload_mode {
+	UPLOAD_NONE,	/* Nothing but blank lines and comments yet */
+	UPLOAD_TEXT,	/* A whole whitelist */
+	UPLOAD_EDIT,	/* "+entry" and "-msr" lines */
+	UPLOAD_BINARY	/* An image */
+};
+
+/*
+ * What has been written to an open /dev/cpu/msr_whitelist since it was
+ * last committed.  Text is parsed a line at a time as it is written, and
+ * an image a record at a time, so only the parsed entries are kept.
+ */
+struct whitelist_upload {
+	struct mutex lock;
+	fl_owner_t owner;		/* File table that opened the file */
+	size_t nbytes;			/* Bytes written since last commit */
+	int err;			/* First error since last commit */
+	enum whitelist_upload_mode mode;
+	int nentries;			/* Entries, or additions of an edit */
+	int maxentries;
+	struct whitelist_entry *entries;
+	int nremoves;			/* Removals of an edit */
+	int maxremoves;
+	struct whitelist_entry *removes;
+	int linelen;
+	char line[MAX_WLIST_LINE + 2];	/* Partial line, room for "\n\0" */
+	char chunk[WLIST_CHUNK];
+	int reclen;			/* Bytes of the current record */
+	u32 nrecords;			/* Records of an image so far */
+	u32 nattrs;			/* Attributes of an image so far */
+	int attrpos;			/* First entry the next one may name */
+	u64 next;			/* Lowest MSR the next record may start at */
+	struct msr_whitelist_header hdr;
+	struct msr_whitelist_record rec;
+	struct msr_whitelist_attr attr;
+};
+
+/*
+ * Every writable whitelisted MSR on every CPU, as read by
+ * X86_IOC_MSR_WHITELIST_SAVE.  The value of msr[i] on CPU c is
+ * data[c * nmsrs + i], and bit c * nmsrs + i of read is set if it could be
+ * read.  mask[i] holds the bits a restore may write.
+ */
+struct whitelist_snapshot {
+	u32 nmsrs;
+	u32 *msr;
+	u64 *wmask;			/* Write masks when saved */
+	u64 *mask;			/* Set by each restore */
+	u64 *data;
+	unsigned long *read;
+	atomic_t nfailed;		/* Failed reads/writes of a restore */
 };
 
 static void delete_whitelist(void);
-static int create_whitelist(int nentries);
-static struct whitelist_entry *find_in_whitelist(u64 msr);
-static void add_to_whitelist(struct whitelist_entry *entry);
+static void install_whitelist(struct whitelist_table *t);
+static struct whitelist_table *swap_whitelist(struct whitelist_table *t,
+								bool vregs);
+static void release_whitelist(struct whitelist_table *old,
+						struct whitelist_table *t);
+static struct whitelist_table *create_whitelist(int nentries);
+static void free_whitelist(struct whitelist_table *t);
+static int whitelist_removed(struct whitelist_table *t, u32 slot);
+static struct whitelist_entry *view_entry(struct whitelist_table *t,
+								loff_t *pos);
+static struct whitelist_entry *next_in_table(struct whitelist_table *t,
+								u64 msr);
+static struct whitelist_entry *next_in_view(struct whitelist_table *t,
+								u64 msr);
+static struct whitelist_entry *find_in_table(struct whitelist_table *t,
+								u64 msr);
+static struct whitelist_entry *find_in_whitelist(struct whitelist_table *t,
+								u64 msr);
+static struct whitelist_entry *lookup_whitelist(struct whitelist_table *t,
+								u64 msr);
+static int index_whitelist(struct whitelist_table *t);
+static int finish_whitelist(struct whitelist_table *t);
+static int upload_bytes(struct whitelist_upload *up, const char *p, size_t n);
+static int upload_line(struct whitelist_upload *up);
+static int upload_record(struct whitelist_upload *up);
+static void record_to_entry(const struct msr_whitelist_record *rec,
+						struct whitelist_entry *e);
+static int apply_attr(const struct msr_whitelist_attr *attr,
+			struct whitelist_entry *entries, int n, int *pos);
+static int commit_upload(struct whitelist_upload *up);
+static void reset_upload(struct whitelist_upload *up);
+static int edit_whitelist(struct whitelist_entry *adds, int nadd,
+				struct whitelist_entry *removes, int nremove);
+static struct whitelist_table *flatten_whitelist(struct whitelist_table *o);
+static int check_entry(struct whitelist_entry *entry);
+static int check_derived_inputs(struct whitelist_table *t);
+static void configure_vregs(struct whitelist_table *t);
+static int parse_attribute(char *attr, unsigned int *width,
+			unsigned int *scope, struct msr_vreg_derived *derived);
+static char *skip_comments(char *s);
 static int parse_next_whitelist_entry(char *inbuf, char **nextinbuf,
 						struct whitelist_entry *entry);
-static ssize_t read_whitelist(struct file *file, char __user *buf,
-						size_t count, loff_t *ppos);
+static int parse_next_whitelist_edit(char *inbuf, char **nextinbuf,
+					struct whitelist_entry *entry, int *remove);
+static int install_builtin_whitelist(void);
 static int majordev;
 static struct class *cdev_class;
 static char cdev_created;
 static char cdev_registered;
 static char cdev_class_created;
 
-static DEFINE_HASHTABLE(whitelist_hash, 6);
-static DEFINE_MUTEX(whitelist_mutex);
-static struct whitelist_entry *whitelist;
-static int whitelist_numentries;
+static DEFINE_MUTEX(whitelist_mutex);	/* Serializes table swaps */
+static struct whitelist_table __rcu *whitelist;
+static atomic_t whitelist_generation;	/* Bumped whenever table changes */
+static struct whitelist_snapshot *snapshot;	/* Under whitelist_mutex */
+
+static bool builtin_whitelist = true;
+module_param(builtin_whitelist, bool, 0444);
+MODULE_PARM_DESC(builtin_whitelist, "Install the built-in whitelist for the boot CPU model at load");
+
+static const char *const scope_names[] = {
+	[MSR_WHITELIST_THREAD] = "thread",
+	[MSR_WHITELIST_CORE] = "core",
+	[MSR_WHITELIST_MODULE] = "module",
+	[MSR_WHITELIST_PACKAGE] = "package"
+};
+
+/*
+ * Return whether reg may be accessed and, if so, its write mask in *wmask
+ * (0 for virtual MSRs, which are read-only).
+ */
+int msr_whitelist_lookup(loff_t reg, u64 *wmask)
+{
+	struct whitelist_table *t;
+	struct whitelist_entry *entry;
+	int found = 0;
+	int slot;
+
+	*wmask = 0;
+	if (reg < 0 || reg > 0xffffffffLL)
+		return 0;
+
+	rcu_read_lock();
+	t = rcu_dereference(whitelist);
+	if (t && !MSR_SAFE_IS_VIRT(reg)) {
+		found = msr_wlindex_lookup(&t->idx, reg, wmask) >= 0;
+		if (!found && t->base) {
+			slot = msr_wlindex_lookup(&t->base->idx, reg, wmask);
+			found = slot >= 0 && !whitelist_removed(t, slot);
+			if (!found)
+				*wmask = 0;
+		}
+	} else {
+		entry = lookup_whitelist(t, reg);
+		found = entry != NULL;
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
+int msr_whitelist_maskexists(loff_t reg)
+{
+	u64 wmask;
+
+	return msr_whitelist_lookup(reg, &wmask);
+}
+
+u64 msr_whitelist_writemask(loff_t reg)
+{
+	u64 wmask;
+
+	msr_whitelist_lookup(reg, &wmask);
+	return wmask;
+}
+
+/*
+ * Lock-free so that it may be sampled from any context.  The generation is
+ * bumped after a new table is published, so a caller that samples it
+ * before checking MSRs against the table can never see an unchanged
+ * generation for a table it did not check against.
+ */
+u64 msr_whitelist_generation(void)
+{
+	u64 gen = atomic_read(&whitelist_generation);
+
+	smp_rmb();	/* Pairs with smp_wmb() in install_whitelist() */
+	return gen;
+}
+
+/*
+ * Reads enumerate the installed whitelist one line per entry, through
+ * seq_file so that each read() fills as much of the buffer as it can.  The
+ * file position is an entry index, so a read() that follows a whitelist
+ * change continues at the same index of the new table.
+ */
+static void *whitelist_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct whitelist_table *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(whitelist);
+	if (!t || *pos < 0)
+		return NULL;
+	return view_entry(t, pos);
+}
+
+static void *whitelist_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct whitelist_table *t = rcu_dereference(whitelist);
+
+	++*pos;
+	return t ? view_entry(t, pos) : NULL;
+}
+
+static void whitelist_seq_stop(struct seq_file *m, void *v)
+{
+	rcu_read_unlock();
+}
+
+static int whitelist_seq_show(struct seq_file *m, void *v)
+{
+	struct whitelist_entry *e = v;
+
+	if (e->last != e->msr)
+		seq_printf(m, "MSR: %08llx-%08llx Write Mask: %016llx",
+						e->msr, e->last, e->wmask);
+	else
+		seq_printf(m, "MSR: %08llx Write Mask: %016llx",
+							e->msr, e->wmask);
+	if (e->width)
+		seq_printf(m, " Width: %u", e->width);
+	if (e->scope)
+		seq_printf(m, " Scope: %s", scope_names[e->scope]);
+	switch (e->derived.op) {
+	case MSR_VREG_DELTA:
+		seq_printf(m, " Delta: %08x", e->derived.in[0]);
+		break;
+	case MSR_VREG_RATE:
+		seq_printf(m, " Rate: %08x", e->derived.in[0]);
+		break;
+	case MSR_VREG_RATIO:
+		seq_printf(m, " Ratio: %08x/%08x",
+					e->derived.in[0], e->derived.in[1]);
+		break;
+	}
+	if (e->derived.op)
+		seq_printf(m, " Scale: %llu", e->derived.scale);
+	seq_puts(m, "\n");
+	return 0;
+}
+
+static const struct seq_operations whitelist_seq_ops = {
+	.start = whitelist_seq_start,
+	.next = whitelist_seq_next,
+	.stop = whitelist_seq_stop,
+	.show = whitelist_seq_show
+};
+
+static int open_whitelist(struct inode *inode, struct file *file)
+{
+	struct whitelist_upload *up = NULL;
+	int err;
+
+	if (file->f_mode & FMODE_WRITE) {
+		up = kzalloc(sizeof(*up), GFP_KERNEL);
+		if (!up)
+			return -ENOMEM;
+		mutex_init(&up->lock);
+		up->owner = current->files;
+	}
+
+	err = seq_open(file, &whitelist_seq_ops);
+	if (err) {
+		kfree(up);
+		return err;
+	}
+	((struct seq_file *)file->private_data)->private = up;
+	return 0;
+}
+
+static int close_whitelist(struct inode *inode, struct file *file)
+{
+	struct whitelist_upload *up =
+			((struct seq_file *)file->private_data)->private;
+	int err;
+
+	if (up) {
+		/* close() cannot see this error, so log it */
+		err = commit_upload(up);
+		if (err)
+			pr_err("close_whitelist: Upload not installed (%d)\n",
+									err);
+		kfree(up);
+	}
+	return seq_release(inode, file);
+}
+
+static bool same_attrs(const struct msr_whitelist_attr *a,
+					const struct msr_whitelist_attr *b)
+{
+	return a->width == b->width && a->scope == b->scope &&
+		a->op == b->op && a->in[0] == b->in[0] &&
+		a->in[1] == b->in[1] && a->scale == b->scale;
+}
+
+/*
+ * Copy the installed whitelist out as msr_whitelist_records and
+ * msr_whitelist_attrs in ascending MSR order, the same ones a binary image
+ * holds.
+ */
+static long dump_whitelist(struct msr_whitelist_dump __user *udump)
+{
+	struct msr_whitelist_dump dump;
+	struct msr_whitelist_record *rec = NULL;
+	struct msr_whitelist_attr *attr = NULL;
+	struct msr_whitelist_attr a;
+	struct whitelist_table *t;
+	struct whitelist_entry *e;
+	bool run = false;		/* Previous entry had attributes */
+	int err = 0;
+	u32 n = 0;
+	u32 na = 0;
+	u32 i;
+
+	if (copy_from_user(&dump, udump, sizeof(dump)))
+		return -EFAULT;
+
+	/* Holding the mutex keeps the installed table from being freed */
+	mutex_lock(&whitelist_mutex);
+	t = rcu_dereference_protected(whitelist,
+					lockdep_is_held(&whitelist_mutex));
+	if (t)
+		n = t->numentries +
+			(t->base ? t->base->numentries - t->nremoved : 0);
+
+	rec = vzalloc(n * sizeof(*rec) + 1);
+	attr = vzalloc(n * sizeof(*attr) + 1);
+	if (!rec || !attr) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+
+	memset(&a, 0, sizeof(a));
+	for (i = 0, e = t ? next_in_view(t, 0) : NULL; e;
+					i++, e = next_in_view(t, e->last + 1)) {
+		rec[i].msr = e->msr;
+		rec[i].last = e->last != e->msr ? e->last : 0;
+		rec[i].wmask = e->wmask;
+
+		a.msr = e->msr;
+		a.width = e->width;
+		a.scope = e->scope;
+		a.op = e->derived.op;
+		a.in[0] = e->derived.in[0];
+		a.in[1] = e->derived.in[1];
+		a.scale = e->derived.op ? e->derived.scale : 0;
+		if (run && same_attrs(&a, &attr[na - 1]))
+			attr[na - 1].last = e->msr;
+		else if ((run = a.width || a.scope || a.op))
+			attr[na++] = a;
+	}
+	if (n > dump.nrecords || na > dump.nattrs)
+		err = -ENOSPC;
+
+out_unlock:
+	mutex_unlock(&whitelist_mutex);
+
+	if (!err && (copy_to_user(dump.records, rec, n * sizeof(*rec)) ||
+			copy_to_user(dump.attrs, attr, na * sizeof(*attr))))
+		err = -EFAULT;
+	if ((!err || err == -ENOSPC) && (put_user(n, &udump->nrecords) ||
+					put_user(na, &udump->nattrs)))
+		err = -EFAULT;
+	vfree(attr);
+	vfree(rec);
+	return err;
+}
+
+static void free_snapshot(struct whitelist_snapshot *s)
+{
+	if (!s)
+		return;
+
+	kfree(s->msr);
+	kfree(s->wmask);
+	kfree(s->mask);
+	vfree(s->data);
+	vfree(s->read);
+	kfree(s);
+}
+
+static void __save_snapshot(void *info)
+{
+	struct whitelist_snapshot *s = info;
+	size_t base = (size_t)smp_processor_id() * s->nmsrs;
+	u32 i;
+
+	for (i = 0; i < s->nmsrs; i++)
+		if (!rdmsrl_safe(s->msr[i], &s->data[base + i]))
+			set_bit(base + i, s->read);
+}
+
+static void __restore_snapshot(void *info)
+{
+	struct whitelist_snapshot *s = info;
+	size_t base = (size_t)smp_processor_id() * s->nmsrs;
+	u64 saved;
+	u64 cur;
+	u32 i;
+
+	for (i = 0; i < s->nmsrs; i++) {
+		if (!s->mask[i] || !test_bit(base + i, s->read))
+			continue;
+		if (rdmsrl_safe(s->msr[i], &cur)) {
+			atomic_inc(&s->nfailed);
+			continue;
+		}
+		saved = s->data[base + i];
+		if (!((cur ^ saved) & s->mask[i]))
+			continue;
+		if (msr_vreg_wrmsrl_safe(s->msr[i],
+				(cur & ~s->mask[i]) | (saved & s->mask[i])))
+			atomic_inc(&s->nfailed);
+	}
+}
+
+/*
+ * Read every writable MSR of the installed whitelist on every online CPU,
+ * in a single round of IPIs, and keep the values in place of any earlier
+ * snapshot.
+ */
+static long save_snapshot(void)
+{
+	struct whitelist_snapshot *s;
+	struct whitelist_table *t;
+	struct whitelist_entry *e;
+	size_t nvals;
+	u64 msr;
+	u32 n = 0;
+	int err = -ENOMEM;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	mutex_lock(&whitelist_mutex);
+	t = rcu_dereference_protected(whitelist,
+					lockdep_is_held(&whitelist_mutex));
+	for (e = t ? next_in_view(t, 0) : NULL; e;
+					e = next_in_view(t, e->last + 1))
+		if (e->wmask && !MSR_SAFE_IS_VIRT(e->msr))
+			n += e->last - e->msr + 1;
+
+	nvals = (size_t)nr_cpu_ids * n;
+	s->nmsrs = n;
+	s->msr = kcalloc(n + 1, sizeof(*s->msr), GFP_KERNEL);
+	s->wmask = kcalloc(n + 1, sizeof(*s->wmask), GFP_KERNEL);
+	s->mask = kcalloc(n + 1, sizeof(*s->mask), GFP_KERNEL);
+	s->data = vzalloc(nvals * sizeof(*s->data) + 1);
+	s->read = vzalloc(BITS_TO_LONGS(nvals) * sizeof(long) + 1);
+	if (!s->msr || !s->wmask || !s->mask || !s->data || !s->read)
+		goto out_unlock;
+
+	n = 0;
+	for (e = t ? next_in_view(t, 0) : NULL; e;
+					e = next_in_view(t, e->last + 1)) {
+		if (!e->wmask || MSR_SAFE_IS_VIRT(e->msr))
+			continue;
+		for (msr = e->msr; msr <= e->last; msr++, n++) {
+			s->msr[n] = msr;
+			s->wmask[n] = e->wmask;
+		}
+	}
+
+	on_each_cpu(__save_snapshot, s, 1);
+
+	swap(s, snapshot);
+	err = 0;
+out_unlock:
+	mutex_unlock(&whitelist_mutex);
+	free_snapshot(s);
+	return err;
+}
+
+/*
+ * Write back the saved value of every writable field that has changed
+ * since, in a single round of IPIs.  Only bits writable both when saved and
+ * under the installed whitelist are restored.
+ */
+static long restore_snapshot(void)
+{
+	struct whitelist_snapshot *s;
+	u64 wmask;
+	u32 i;
+	int err = 0;
+
+	mutex_lock(&whitelist_mutex);
+	s = snapshot;
+	if (!s) {
+		err = -ENODATA;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < s->nmsrs; i++) {
+		msr_whitelist_lookup(s->msr[i], &wmask);
+		s->mask[i] = s->wmask[i] & wmask;
+	}
+	atomic_set(&s->nfailed, 0);
+
+	on_each_cpu(__restore_snapshot, s, 1);
+
+	if (atomic_read(&s->nfailed))
+		err = -EIO;
+out_unlock:
+	mutex_unlock(&whitelist_mutex);
+	return err;
+}
+
+static long ioctl_whitelist(struct file *file, unsigned int ioc,
+							unsigned long arg)
+{
+	switch (ioc) {
+	case X86_IOC_MSR_WHITELIST_DUMP:
+		return dump_whitelist((struct msr_whitelist_dump __user *)arg);
+	case X86_IOC_MSR_WHITELIST_SAVE:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return save_snapshot();
+	case X86_IOC_MSR_WHITELIST_RESTORE:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return restore_snapshot();
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Writes accumulate in the file's upload and are parsed as they arrive;
+ * nothing changes until the upload is committed.  fsync() commits it and
+ * so does close() by the process that opened the file, either returning
+ * any error; a descriptor inherited or passed elsewhere commits nothing
+ * when closed, and whatever is still pending is committed when the last
+ * reference to the file goes away.  An error in any write fails that
+ * write and every later one, and the commit that follows reports it
+ * again and installs nothing.
+ */
+static ssize_t write_whitelist(struct file *file, const char __user *buf,
+						size_t count, loff_t *ppos)
+{
+	struct whitelist_upload *up =
+			((struct seq_file *)file->private_data)->private;
+	size_t done;
+	size_t n;
+	int err;
+
+	mutex_lock(&up->lock);
+	for (done = 0, err = up->err; !err && done < count; done += n) {
+		n = min_t(size_t, count - done, WLIST_CHUNK);
+		if (copy_from_user(up->chunk, buf + done, n))
+			err = -EFAULT;
+		else
+			err = upload_bytes(up, up->chunk, n);
+	}
+	up->err = err;
+	mutex_unlock(&up->lock);
+	return err ? err : count;
+}
+
+static int sync_whitelist(struct file *file)
+{
+	struct whitelist_upload *up =
+			((struct seq_file *)file->private_data)->private;
+	int err;
+
+	if (!up)
+		return 0;
+
+	mutex_lock(&up->lock);
+	err = commit_upload(up);
+	mutex_unlock(&up->lock);
+	return err;
+}
+
+static int flush_whitelist(struct file *file, fl_owner_t id)
+{
+	struct whitelist_upload *up =
+			((struct seq_file *)file->private_data)->private;
+
+	if (!up || id != up->owner)
+		return 0;
+	return sync_whitelist(file);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
+static int fsync_whitelist(struct file *file, int datasync)
+#else
+static int fsync_whitelist(struct file *file, loff_t start, loff_t end,
+								int datasync)
+#endif
+{
+	return sync_whitelist(file);
+}
+
+/*
+ * An image is recognized by the first byte of its magic, which cannot
+ * start a line of text.
+ */
+static int upload_bytes(struct whitelist_upload *up, const char *p, size_t n)
+{
+	char *dst;
+	size_t len;
+	int err;
+
+	if (up->nbytes == 0 && n && p[0] == (char)(MSR_WHITELIST_MAGIC & 0xff))
+		up->mode = UPLOAD_BINARY;
+	up->nbytes += n;
+
+	while (n) {
+		if (up->mode == UPLOAD_BINARY) {
+			if (up->nrecords == 0 && up->reclen < sizeof(up->hdr)) {
+				dst = (char *)&up->hdr + up->reclen;
+				len = sizeof(up->hdr) - up->reclen;
+			} else if (up->nrecords <= up->hdr.nrecords) {
+				dst = (char *)&up->rec + up->reclen;
+				len = sizeof(up->rec) - up->reclen;
+			} else {
+				dst = (char *)&up->attr + up->reclen;
+				len = sizeof(up->attr) - up->reclen;
+			}
+			len = min(len, n);
+			memcpy(dst, p, len);
+			up->reclen += len;
+			p += len;
+			n -= len;
+			err = upload_record(up);
+		} else {
+			up->line[up->linelen++] = *p;
+			err = 0;
+			if (*p == '\n') {
+				err = upload_line(up);
+			} else if (up->linelen == MAX_WLIST_LINE) {
+				pr_err("write_whitelist: Line too long\n");
+				err = -EINVAL;
+			}
+			p++;
+			n--;
+		}
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int append_entry(struct whitelist_entry **entries, int *n, int *max,
+						struct whitelist_entry *e)
+{
+	struct whitelist_entry *tmp;
+	int newmax;
+
+	if (*n == *max) {
+		newmax = *max ? 2 * *max : 64;
+		tmp = krealloc(*entries, newmax * sizeof(*tmp), GFP_KERNEL);
+		if (!tmp)
+			return -ENOMEM;
+		*entries = tmp;
+		*max = newmax;
+	}
+	(*entries)[(*n)++] = *e;
+	return 0;
+}
+
+/*
+ * Parse the complete line in up->line.  The first line that holds more
+ * than comments decides whether the upload is a whitelist or edits.
+ */
+static int upload_line(struct whitelist_upload *up)
+{
+	struct whitelist_entry e;
+	char *s = up->line;
+	int remove;
+	int res;
+	int err = 0;
+
+	up->line[up->linelen] = 0;
+	up->linelen = 0;
+	if (up->mode == UPLOAD_NONE && *(s = skip_comments(s)))
+		up->mode = (*s == '+' || *s == '-') ? UPLOAD_EDIT : UPLOAD_TEXT;
+
+	for (res = 1; !err && res > 0; ) {
+		if (up->mode == UPLOAD_EDIT) {
+			res = parse_next_whitelist_edit(s, &s, &e, &remove);
+			if (res > 0 && remove)
+				err = append_entry(&up->removes, &up->nremoves,
+							&up->maxremoves, &e);
+			else if (res > 0)
+				err = append_entry(&up->entries, &up->nentries,
+							&up->maxentries, &e);
+		} else {
+			res = parse_next_whitelist_entry(s, &s, &e);
+			if (res > 0)
+				err = append_entry(&up->entries, &up->nentries,
+							&up->maxentries, &e);
+		}
+	}
+	return res < 0 ? res : err;
+}
+
+/*
+ * Check the image header, turn a complete record into an entry, or add a
+ * complete attribute to the entry it names.  Records and attributes must
+ * already be sorted, which also rules out overlaps; entries are checked
+ * once the whole image is in.
+ */
+static int upload_record(struct whitelist_upload *up)
+{
+	struct msr_whitelist_record *rec = &up->rec;
+	struct whitelist_entry e;
+
+	BUILD_BUG_ON(MSR_VREG_DELTA != MSR_WHITELIST_DELTA);
+	BUILD_BUG_ON(MSR_VREG_RATE != MSR_WHITELIST_RATE);
+	BUILD_BUG_ON(MSR_VREG_RATIO != MSR_WHITELIST_RATIO);
+
+	if (up->nrecords == 0 && up->reclen == sizeof(up->hdr)) {
+		if (up->hdr.magic != MSR_WHITELIST_MAGIC ||
+				up->hdr.version != MSR_WHITELIST_VERSION ||
+				up->hdr.nattrs > up->hdr.nrecords) {
+			pr_err("write_whitelist: Bad image header\n");
+			return -EINVAL;
+		}
+		up->reclen = 0;
+		up->nrecords = 1;	/* Counts the header */
+		return 0;
+	}
+	if (up->nrecords == 0)
+		return 0;
+
+	if (up->nrecords > up->hdr.nrecords) {
+		if (up->reclen < sizeof(up->attr))
+			return 0;
+		up->reclen = 0;
+		if (up->nattrs++ >= up->hdr.nattrs ||
+				apply_attr(&up->attr, up->entries,
+					up->nentries, &up->attrpos)) {
+			pr_err("write_whitelist: Bad image attribute %u\n",
+							up->nattrs - 1);
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	if (up->reclen < sizeof(*rec))
+		return 0;
+	up->reclen = 0;
+	if (rec->msr < up->next || (rec->last && rec->last <= rec->msr)) {
+		pr_err("write_whitelist: Bad image record %u\n",
+							up->nrecords - 1);
+		return -EINVAL;
+	}
+	up->nrecords++;
+
+	record_to_entry(rec, &e);
+	up->next = e.last + 1;
+	return append_entry(&up->entries, &up->nentries, &up->maxentries, &e);
+}
+
+static void record_to_entry(const struct msr_whitelist_record *rec,
+						struct whitelist_entry *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->msr = rec->msr;
+	e->last = rec->last ? rec->last : rec->msr;
+	e->wmask = rec->wmask;
+}
+
+/*
+ * Give the entries that attr covers, starting at or after entries[*pos],
+ * its attributes, and move *pos past them.  Fails unless one of them
+ * starts at attr->msr, as when attributes are out of order.
+ */
+static int apply_attr(const struct msr_whitelist_attr *attr,
+			struct whitelist_entry *entries, int n, int *pos)
+{
+	struct whitelist_entry *e;
+	u32 last = attr->last ? attr->last : attr->msr;
+
+	while (*pos < n && entries[*pos].msr < attr->msr)
+		(*pos)++;
+	if (*pos == n || entries[*pos].msr != attr->msr || last < attr->msr)
+		return -EINVAL;
+
+	for (; *pos < n && entries[*pos].msr <= last; (*pos)++) {
+		e = &entries[*pos];
+		e->width = attr->width;
+		e->scope = attr->scope;
+		e->derived.op = attr->op;
+		e->derived.in[0] = attr->in[0];
+		e->derived.in[1] = attr->in[1];
+		e->derived.scale = attr->scale;
+	}
+	return 0;
+}
+
+/*
+ * Install what has been written since the last commit, if anything.  A
+ * write of at most two bytes (such as "echo > /dev/cpu/msr_whitelist")
+ * removes the whitelist.  The new whitelist is built without holding a
+ * lock and then replaces the current one in a single pointer swap; on any
+ * error the current whitelist stays.
+ */
+static int commit_upload(struct whitelist_upload *up)
+{
+	struct whitelist_table *t;
+	int err = up->err;
+	int i;
+
+	if (up->nbytes == 0)
+		return 0;
+
+	if (!err && up->nbytes <= 2) {
+		delete_whitelist();
+		goto out;
+	}
+
+	/* The last line need not end in a newline */
+	if (!err && up->mode != UPLOAD_BINARY && up->linelen) {
+		up->line[up->linelen++] = '\n';
+		err = upload_line(up);
+	}
+	if (err)
+		goto out;
+
+	switch (up->mode) {
+	case UPLOAD_EDIT:
+		err = edit_whitelist(up->entries, up->nentries,
+					up->removes, up->nremoves);
+		break;
+	case UPLOAD_BINARY:
+		if (up->reclen || up->nrecords != up->hdr.nrecords + 1 ||
+					up->nattrs != up->hdr.nattrs) {
+			pr_err("write_whitelist: Truncated image\n");
+			err = -EINVAL;
+			break;
+		}
+		for (i = 0; !err && i < up->nentries; i++)
+			err = check_entry(&up->entries[i]);
+		if (err)
+			break;
+		/* fall through */
+	default:
+		t = create_whitelist(up->nentries);
+		if (!t) {
+			err = -ENOMEM;
+			break;
+		}
+		memcpy(t->entries, up->entries,
+					up->nentries * sizeof(*t->entries));
+		err = finish_whitelist(t);
+		break;
+	}
+out:
+	reset_upload(up);
+	return err;
+}
+
+static void reset_upload(struct whitelist_upload *up)
+{
+	kfree(up->entries);
+	kfree(up->removes);
+	up->entries = NULL;
+	up->removes = NULL;
+	up->nentries = up->maxentries = 0;
+	up->nremoves = up->maxremoves = 0;
+	up->nbytes = 0;
+	up->err = 0;
+	up->mode = UPLOAD_NONE;
+	up->linelen = 0;
+	up->reclen = 0;
+	up->nrecords = 0;
+	up->nattrs = 0;
+	up->attrpos = 0;
+	up->next = 0;
+}
+
+static int cmp_slot(const void *a, const void *b)
+{
+	const u32 *sa = a;
+	const u32 *sb = b;
+
+	return *sa < *sb ? -1 : *sa > *sb;
+}
+
+/*
+ * Apply a list of "+entry" and "-msr" edits to the installed whitelist.
+ * All removals are applied before any addition, so "-msr" followed by
+ * "+msr mask" replaces an entry.  "-msr" removes the whole entry that
+ * starts at msr.  The edits are checked and published together, or not
+ * at all.  The mutex is held while the edits are applied, so that none is
+ * lost, but the work done is in proportion to the edits and to the edit
+ * table they replace, not to the whole whitelist.
+ */
+static int edit_whitelist(struct whitelist_entry *adds, int nadd,
+				struct whitelist_entry *removes, int nremove)
+{
+	struct whitelist_table *cur;
+	struct whitelist_table *base;
+	struct whitelist_table *o = NULL;
+	struct whitelist_table *flat;
+	struct whitelist_entry *e;
+	u32 *removed = NULL;	/* Base slots removed, old and new */
+	bool *drop = NULL;	/* Earlier additions removed */
+	bool vregs = false;
+	u64 msr;
+	int nprev;
+	int nkept;
+	int nrem;
+	int err = 0;
+	int i;
+	int j;
+
+	mutex_lock(&whitelist_mutex);
+	cur = rcu_dereference_protected(whitelist,
+					lockdep_is_held(&whitelist_mutex));
+	base = cur && cur->base ? cur->base : cur;
+	nprev = cur && cur->base ? cur->numentries : 0;
+	nrem = cur && cur->base ? cur->nremoved : 0;
+
+	drop = kcalloc(nprev, sizeof(*drop), GFP_KERNEL);
+	removed = kmalloc_array(nrem + nremove, sizeof(*removed), GFP_KERNEL);
+	if ((nprev && !drop) || (nrem + nremove && !removed)) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+	if (nrem)
+		memcpy(removed, cur->removed, nrem * sizeof(*removed));
+
+	for (i = 0, nkept = nprev; i < nremove; i++) {
+		msr = removes[i].msr;
+		e = nprev ? find_in_table(cur, msr) : NULL;
+		if (e && e->msr == msr && !drop[e - cur->entries]) {
+			drop[e - cur->entries] = true;
+			nkept--;
+		} else {
+			e = base ? find_in_table(base, msr) : NULL;
+			if (!e || e->msr != msr ||
+					whitelist_removed(cur, e - base->entries)) {
+				pr_err("edit_whitelist: %llx not whitelisted\n",
+									msr);
+				err = -EINVAL;
+				goto out_unlock;
+			}
+			removed[nrem++] = e - base->entries;
+		}
+		vregs |= e->width || e->derived.op;
+	}
+	sort(removed, nrem, sizeof(*removed), cmp_slot, NULL);
+	for (i = 1; i < nrem; i++) {
+		if (removed[i] == removed[i - 1]) {
+			pr_err("edit_whitelist: %llx removed twice\n",
+					base->entries[removed[i]].msr);
+			err = -EINVAL;
+			goto out_unlock;
+		}
+	}
+
+	o = create_whitelist(nkept + nadd);
+	if (!o) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+	o->base = base;
+	o->nremoved = nrem;
+	o->removed = removed;
+	removed = NULL;
+
+	for (i = 0, j = 0; i < nprev; i++) {
+		if (drop[i])
+			continue;
+		o->entries[j++] = cur->entries[i];
+	}
+	for (i = 0; i < nadd; i++, j++) {
+		o->entries[j] = adds[i];
+		vregs |= adds[i].width || adds[i].derived.op;
+	}
+
+	/* Additions must not overlap each other or what is left of base */
+	err = index_whitelist(o);
+	for (i = nkept; !err && base && i < o->numentries; i++) {
+		for (e = next_in_table(base, o->entries[i].msr);
+			e && e->msr <= o->entries[i].last;
+			e = next_in_table(base, e->last + 1)) {
+			if (!whitelist_removed(o, e - base->entries)) {
+				pr_err("edit_whitelist: Duplicate: %llx\n",
+								e->msr);
+				err = -EINVAL;
+				break;
+			}
+		}
+	}
+	if (!err)
+		err = check_derived_inputs(o);
 
-int msr_whitelist_maskexists(loff_t reg)
-{
-	struct whitelist_entry *entry;
+	if (!err && base && o->numentries + o->nremoved >
+			max(MIN_WLIST_COMPACT, base->numentries / 8)) {
+		flat = flatten_whitelist(o);
+		if (!flat)
+			err = -ENOMEM;
+		free_whitelist(o);
+		o = flat;
+	}
 
-	mutex_lock(&whitelist_mutex);
-	entry = find_in_whitelist((u64)reg);
+	if (!err)
+		cur = swap_whitelist(o, vregs);
+out_unlock:
 	mutex_unlock(&whitelist_mutex);
 
-	return entry != NULL;
+	if (!err) {
+		synchronize_rcu();
+		release_whitelist(cur, o);
+	} else {
+		free_whitelist(o);
+	}
+	kfree(removed);
+	kfree(drop);
+	return err;
 }
 
-u64 msr_whitelist_writemask(loff_t reg)
+/*
+ * Merge the edit table o with its base into a new full table, in the
+ * order in which reads enumerate them.
+ */
+static struct whitelist_table *flatten_whitelist(struct whitelist_table *o)
 {
-	struct whitelist_entry *entry;
+	struct whitelist_table *t;
+	struct whitelist_entry *e;
+	loff_t pos;
+	int i;
+
+	t = create_whitelist(o->numentries + o->base->numentries - o->nremoved);
+	if (!t)
+		return NULL;
+
+	for (pos = 0, i = 0; (e = view_entry(o, &pos)); pos++, i++)
+		t->entries[i] = *e;
+
+	if (index_whitelist(t)) {
+		free_whitelist(t);
+		return NULL;
+	}
+	return t;
+}
+
+static const struct file_operations fops = {
+	.owner = THIS_MODULE,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.write = write_whitelist,
+	.open = open_whitelist,
+	.flush = flush_whitelist,
+	.fsync = fsync_whitelist,
+	.release = close_whitelist,
+	.unlocked_ioctl = ioctl_whitelist,
+	.compat_ioctl = ioctl_whitelist
+};
+
+static void delete_whitelist(void)
+{
+	install_whitelist(NULL);
+}
+
+/*
+ * Publish the fully built table t (NULL for no whitelist) and free the
+ * table it replaces once no reader can still be using it.
+ */
+static void install_whitelist(struct whitelist_table *t)
+{
+	struct whitelist_table *old;
 
 	mutex_lock(&whitelist_mutex);
-	entry = find_in_whitelist((u64)reg);
+	old = swap_whitelist(t, true);
 	mutex_unlock(&whitelist_mutex);
 
-	return entry ? entry->wmask : 0;
+	synchronize_rcu();
+	release_whitelist(old, t);
 }
 
-static int open_whitelist(struct inode *inode, struct file *file)
+/*
+ * Publish t and return the table it replaces.  The virtual MSRs are only
+ * reconfigured if vregs is set, as edits that leave every width= and
+ * derived entry alone do not change them.  Called with whitelist_mutex
+ * held.
+ */
+static struct whitelist_table *swap_whitelist(struct whitelist_table *t,
+								bool vregs)
 {
-	return 0;
+	struct whitelist_table *old;
+
+	old = rcu_dereference_protected(whitelist,
+					lockdep_is_held(&whitelist_mutex));
+	rcu_assign_pointer(whitelist, t);
+	smp_wmb();	/* Publish the table before the new generation */
+	atomic_inc(&whitelist_generation);
+	if (vregs)
+		configure_vregs(t);
+	return old;
 }
 
 /*
- * After copying data from user space, we make two passes through it.
- * The first pass is to ensure that the input file is valid. If the file is
- * valid, we will then delete the current white list and then perform the
- * second pass to actually create the new white list.
+ * Free the replaced table old, and its base, unless the new table t still
+ * uses them.
  */
-static ssize_t write_whitelist(struct file *file, const char __user *buf,
-						size_t count, loff_t *ppos)
+static void release_whitelist(struct whitelist_table *old,
+						struct whitelist_table *t)
 {
-	int err = 0;
-	const u32 __user *tmp = (const u32 __user *)buf;
-	char *s;
-	int res;
-	int num_entries;
-	struct whitelist_entry *entry;
-	char *kbuf;
+	if (!old || (t && old == t->base))
+		return;
 
-	if (count <= 2) {
-		mutex_lock(&whitelist_mutex);
-		delete_whitelist();
-		hash_init(whitelist_hash);
-		mutex_unlock(&whitelist_mutex);
-		return count;
+	if (old->base && (!t || old->base != t->base))
+		free_whitelist(old->base);
+	free_whitelist(old);
+}
+
+static struct whitelist_table *create_whitelist(int nentries)
+{
+	struct whitelist_table *t;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return NULL;
+
+	t->entries = kcalloc(nentries, sizeof(*t->entries), GFP_KERNEL);
+	if (!t->entries) {
+		kfree(t);
+		return NULL;
 	}
+	t->numentries = nentries;
+	return t;
+}
 
-	if (count+1 > MAX_WLIST_BSIZE) {
-		pr_err("write_whitelist: buffer of %zu bytes too large\n",
-		    count);
-		return -EINVAL;
+static void free_whitelist(struct whitelist_table *t)
+{
+	if (t == 0)
+		return;
+
+	kfree(t->idx.blocks);
+	kfree(t->idx.wmask);
+	kfree(t->idx.slot);
+	kfree(t->idx.ranges);
+	kfree(t->removed);
+	kfree(t->entries);
+	kfree(t);
+}
+
+/*
+ * Return whether base slot has been removed by the edit table t.
+ */
+static int whitelist_removed(struct whitelist_table *t, u32 slot)
+{
+	int lo = 0;
+	int hi = t && t->base ? t->nremoved : 0;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->removed[mid] == slot)
+			return 1;
+		if (t->removed[mid] < slot)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return 0;
+}
 
-	kbuf = kzalloc(count+1, GFP_KERNEL);
-	if (!kbuf)
-		return -ENOMEM;
+/*
+ * Return the entry at or after *pos of the whitelist as read: the base
+ * entries that were not removed, then the entries of t, each in input
+ * order.  *pos is advanced past removed entries.
+ */
+static struct whitelist_entry *view_entry(struct whitelist_table *t,
+								loff_t *pos)
+{
+	int nbase = t->base ? t->base->numentries : 0;
 
-	if (copy_from_user(kbuf, tmp, count)) {
-		err = -EFAULT;
-		goto out_freebuffer;
+	for (; *pos < nbase; ++*pos)
+		if (!whitelist_removed(t, *pos))
+			return &t->base->entries[*pos];
+	if (*pos - nbase < t->numentries)
+		return &t->entries[*pos - nbase];
+	return NULL;
+}
+
+/*
+ * Return the entry of t itself with the lowest address that ends at or
+ * above msr, or NULL if there is none.
+ */
+static struct whitelist_entry *next_in_table(struct whitelist_table *t,
+								u64 msr)
+{
+	struct msr_wlindex *idx = &t->idx;
+	struct whitelist_entry *p = NULL;
+	struct whitelist_entry *r = NULL;
+	int lo = 0;
+	int hi = t->numentries - idx->nranges;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->entries[idx->slot[mid]].msr < msr)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	if (lo < t->numentries - idx->nranges)
+		p = &t->entries[idx->slot[lo]];
 
-	/* Pass 1: */
-	for (num_entries = 0, s = kbuf, res = 1; res > 0; ) {
-		res = parse_next_whitelist_entry(s, &s, 0);
-		if (res < 0) {
-			err = res;
-			goto out_freebuffer;
-		}
+	for (lo = 0, hi = idx->nranges; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->ranges[mid].last < msr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < idx->nranges)
+		r = &t->entries[idx->ranges[lo].slot];
+
+	return !r || (p && p->msr < r->msr) ? p : r;
+}
+
+/*
+ * Like next_in_table(), but over the whitelist as seen through the edit
+ * table t.
+ */
+static struct whitelist_entry *next_in_view(struct whitelist_table *t,
+								u64 msr)
+{
+	struct whitelist_entry *a = next_in_table(t, msr);
+	struct whitelist_entry *b = NULL;
 
-		if (res)
-			num_entries++;
+	if (t->base) {
+		for (b = next_in_table(t->base, msr);
+			b && whitelist_removed(t, b - t->base->entries);
+			b = next_in_table(t->base, b->last + 1))
+			;
 	}
+	return !b || (a && a->msr < b->msr) ? a : b;
+}
 
-	/* Pass 2: */
-	mutex_lock(&whitelist_mutex);
-	res = create_whitelist(num_entries);
-	if (res < 0) {
-		err = res;
-		goto out_releasemutex;
-	}
-
-	for (entry = whitelist, s = kbuf, res = 1; res > 0; entry++) {
-		res = parse_next_whitelist_entry(s, &s, entry);
-		if (res < 0) {
-			pr_alert("write_whitelist: Table corrupted\n");
-			delete_whitelist();
-			err = res; /* This should not happen! */
-			goto out_releasemutex;
-		}
+static int cmp_key(const void *a, const void *b)
+{
+	const struct whitelist_key *ka = a;
+	const struct whitelist_key *kb = b;
 
-		if (res) {
-			if (find_in_whitelist(entry->msr)) {
-				pr_err("write_whitelist: Duplicate: %llx\n",
-							 entry->msr);
-				err = -EINVAL;
-				delete_whitelist();
-				goto out_releasemutex;
-			}
-			add_to_whitelist(entry);
-		}
+	return ka->msr < kb->msr ? -1 : ka->msr > kb->msr;
+}
+
+/*
+ * Index and check a fully parsed table, then install it or, on error, free
+ * it and keep the current one.
+ */
+static int finish_whitelist(struct whitelist_table *t)
+{
+	int err;
+
+	err = index_whitelist(t);
+	if (!err)
+		err = check_derived_inputs(t);
+	if (err) {
+		free_whitelist(t);
+		return err;
 	}
 
-out_releasemutex:
-	mutex_unlock(&whitelist_mutex);
-out_freebuffer:
-	kfree(kbuf);
-	return err ? err : count;
+	install_whitelist(t);
+	return 0;
 }
 
-static ssize_t read_whitelist(struct file *file, char __user *buf,
-						size_t count, loff_t *ppos)
+/*
+ * Build the lookup index of a fully parsed table, rejecting duplicates and
+ * overlapping ranges.  Ranges stay ranges in the index.
+ */
+static int index_whitelist(struct whitelist_table *t)
 {
-	loff_t idx = *ppos;
-	u32 __user *tmp = (u32 __user *) buf;
-	char kbuf[160];
-	int len;
-	struct whitelist_entry e;
+	struct msr_wlindex *idx = &t->idx;
+	struct whitelist_entry *e;
+	struct whitelist_key *keys;
+	u32 *msrs;
+	int n = t->numentries;
+	int nranges = 0;
+	int npoints;
+	int err = -ENOMEM;
+	u64 next = 0;
+	int i;
 
-	mutex_lock(&whitelist_mutex);
-	*ppos = 0;
+	for (i = 0; i < n; i++)
+		if (t->entries[i].last != t->entries[i].msr)
+			nranges++;
+	npoints = n - nranges;
 
-	if (idx >= whitelist_numentries || idx < 0) {
-		mutex_unlock(&whitelist_mutex);
-		return 0;
+	keys = kmalloc_array(n, sizeof(*keys), GFP_KERNEL);
+	msrs = kmalloc_array(npoints, sizeof(*msrs), GFP_KERNEL);
+	idx->blocks = kmalloc_array(msr_wlindex_nblocks(npoints),
+					sizeof(*idx->blocks), GFP_KERNEL);
+	idx->wmask = kmalloc_array(npoints, sizeof(*idx->wmask), GFP_KERNEL);
+	idx->slot = kmalloc_array(npoints, sizeof(*idx->slot), GFP_KERNEL);
+	idx->ranges = kmalloc_array(nranges, sizeof(*idx->ranges), GFP_KERNEL);
+	if (!keys || !idx->blocks || (npoints && (!msrs || !idx->wmask ||
+		!idx->slot)) || (nranges && !idx->ranges))
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		keys[i].msr = t->entries[i].msr;
+		keys[i].slot = i;
 	}
+	sort(keys, n, sizeof(*keys), cmp_key, NULL);
 
-	e = whitelist[idx];
-	mutex_unlock(&whitelist_mutex);
+	for (i = 0, npoints = 0, idx->nranges = 0; i < n; i++) {
+		e = &t->entries[keys[i].slot];
+		if (e->msr < next) {
+			pr_err("write_whitelist: Duplicate: %x\n", keys[i].msr);
+			err = -EINVAL;
+			goto out;
+		}
+		next = e->last + 1;
 
-	len = sprintf(kbuf,
-		"MSR: %08llx Write Mask: %016llx\n", e.msr, e.wmask);
+		if (e->last != e->msr) {
+			idx->ranges[idx->nranges].first = e->msr;
+			idx->ranges[idx->nranges].last = e->last;
+			idx->ranges[idx->nranges].wmask = e->wmask;
+			idx->ranges[idx->nranges].slot = keys[i].slot;
+			idx->ranges[idx->nranges++].pad = 0;
+			continue;
+		}
+		msrs[npoints] = keys[i].msr;
+		idx->wmask[npoints] = e->wmask;
+		idx->slot[npoints++] = keys[i].slot;
+	}
+	msr_wlindex_build(idx, msrs, npoints);
+	err = 0;
+out:
+	kfree(msrs);
+	kfree(keys);
+	return err;
+}
 
-	if (len > count)
-		return -EFAULT;
+static struct whitelist_entry *find_in_table(struct whitelist_table *t,
+								u64 msr)
+{
+	int slot;
 
-	if (copy_to_user(tmp, kbuf, len))
-		return -EFAULT;
+	if (!t || msr > 0xffffffffULL)
+		return 0;
 
-	*ppos = idx+1;
-	return len;
+	slot = msr_wlindex_lookup(&t->idx, msr, NULL);
+	return slot < 0 ? 0 : &t->entries[slot];
 }
 
-static const struct file_operations fops = {
-	.owner = THIS_MODULE,
-	.read = read_whitelist,
-	.write = write_whitelist,
-	.open = open_whitelist
-};
+/*
+ * Like find_in_table(), but also looks through an edit table to its base.
+ */
+static struct whitelist_entry *find_in_whitelist(struct whitelist_table *t,
+								u64 msr)
+{
+	struct whitelist_entry *entry = find_in_table(t, msr);
 
-static void delete_whitelist(void)
+	if (entry || !t || !t->base)
+		return entry;
+
+	entry = find_in_table(t->base, msr);
+	return entry && !whitelist_removed(t, entry - t->base->entries) ?
+								entry : 0;
+}
+
+/*
+ * Like find_in_whitelist(), but also resolves the virtual accumulator
+ * address of a counter that was declared with a width.
+ */
+static struct whitelist_entry *lookup_whitelist(struct whitelist_table *t,
+								u64 msr)
 {
-	if (whitelist == 0)
-		return;
+	struct whitelist_entry *entry;
 
-	if (whitelist->msrdata != 0)
-		kfree(whitelist->msrdata);
+	if (!MSR_SAFE_IS_VIRT(msr) || MSR_SAFE_IS_DERIVED(msr))
+		return find_in_whitelist(t, msr);
 
-	kfree(whitelist);
-	whitelist = 0;
-	whitelist_numentries = 0;
+	entry = find_in_whitelist(t, msr & ~(u64)MSR_SAFE_VIRT_BASE);
+	return entry && entry->width ? entry : 0;
 }
 
-static int create_whitelist(int nentries)
+/*
+ * Derived registers may only be computed from hardware MSRs that are
+ * themselves whitelisted.
+ */
+static int check_derived_inputs(struct whitelist_table *t)
 {
-	hash_init(whitelist_hash);
-	delete_whitelist();
-	whitelist_numentries = nentries;
-	whitelist = kcalloc(nentries, sizeof(*whitelist), GFP_KERNEL);
+	struct msr_vreg_derived *d;
+	struct whitelist_entry *e;
+	struct whitelist_entry *in;
+	int j;
 
-	if (!whitelist)
-		return -ENOMEM;
+	for (e = next_in_view(t, MSR_SAFE_DERIVED_BASE);
+		e && MSR_SAFE_IS_DERIVED(e->msr); e = next_in_view(t, e->last + 1)) {
+		d = &e->derived;
+		for (j = 0; j < (d->op == MSR_VREG_RATIO ? 2 : 1); j++) {
+			in = find_in_whitelist(t, d->in[j]);
+			if (!in || MSR_SAFE_IS_VIRT(in->msr)) {
+				pr_err("check_derived_inputs: %x not whitelisted for %x\n",
+							d->in[j], d->msr);
+				return -EINVAL;
+			}
+		}
+	}
 	return 0;
 }
 
-static struct whitelist_entry *find_in_whitelist(u64 msr)
+/*
+ * Hand the counters declared with a width and the derived registers of
+ * the newly installed table t to msr_vreg.  Called with whitelist_mutex
+ * held.
+ */
+static void configure_vregs(struct whitelist_table *t)
 {
-	struct whitelist_entry *entry = 0;
+	struct msr_vreg_counter *counters = NULL;
+	struct msr_vreg_derived *derived = NULL;
+	struct whitelist_entry *e;
+	loff_t pos;
+	u64 msr;
+	u64 nc = 0;
+	int n;
+	int nd = 0;
+	int err;
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,39)
-	struct hlist_node *node;
-	if (whitelist) {
-		hash_for_each_possible(whitelist_hash, entry, node, hlist, msr)
-			if (entry && entry->msr == msr)
-				return entry;
+	for (pos = 0; t && (e = view_entry(t, &pos)); pos++) {
+		if (e->width)
+			nc += e->last - e->msr + 1;
+		if (e->derived.op)
+			nd++;
 	}
-#else
-	if (whitelist) {
-		hash_for_each_possible(whitelist_hash, entry, hlist, msr)
-			if (entry && entry->msr == msr)
-				return entry;
+
+	if (nc == 0 && nd == 0) {
+		msr_vreg_configure(NULL, 0, NULL, 0, false);
+		return;
+	}
+
+	/* A range declared with a width is a counter per MSR */
+	n = min_t(u64, nc, INT_MAX);
+	counters = nc > INT_MAX ? NULL :
+			kmalloc_array(n, sizeof(*counters), GFP_KERNEL);
+	derived = kmalloc_array(nd, sizeof(*derived), GFP_KERNEL);
+	if ((n && !counters) || (nd && !derived)) {
+		err = -ENOMEM;
+		goto out_err;
 	}
-#endif
-	return 0;
-}
 
+	for (pos = 0, n = 0, nd = 0; (e = view_entry(t, &pos)); pos++) {
+		for (msr = e->msr; e->width && msr <= e->last; msr++) {
+			counters[n].msr = msr;
+			counters[n].width = e->width;
+			n++;
+		}
+		if (e->derived.op)
+			derived[nd++] = e->derived;
+	}
+
+	err = msr_vreg_configure(counters, n, derived, nd, t->builtin);
+	if (!err)
+		goto out_free;
+out_err:
+	pr_err("configure_vregs: virtual MSRs disabled: %d\n", err);
+	msr_vreg_configure(NULL, 0, NULL, 0, false);
+out_free:
+	kfree(derived);
+	kfree(counters);
+}
 
-static void add_to_whitelist(struct whitelist_entry *entry)
+/*
+ * Attributes are width=N for a counter msr_vreg should extend, scope=thread,
+ * core, module or package for a real MSR, and for an address in the
+ * MSR_SAFE_DERIVED range exactly one of delta=MSR, rate=MSR or
+ * ratio=MSR/MSR, optionally with scale=N.
+ */
+static int parse_attribute(char *attr, unsigned int *width,
+			unsigned int *scope, struct msr_vreg_derived *derived)
 {
-	hash_add(whitelist_hash, &entry->hlist, entry->msr);
+	char *slash;
+	int err;
+	u32 op = MSR_VREG_NONE;
+
+	if (strncmp(attr, "width=", 6) == 0) {
+		err = kstrtouint(attr + 6, 0, width);
+		if (!err && (*width == 0 || *width >= 64))
+			err = -ERANGE;
+		return err;
+	}
+
+	if (strncmp(attr, "scope=", 6) == 0) {
+		for (*scope = 0; *scope < ARRAY_SIZE(scope_names); ++*scope)
+			if (strcmp(attr + 6, scope_names[*scope]) == 0)
+				return 0;
+		pr_err("parse_attribute: Unknown scope %s\n", attr + 6);
+		return -EINVAL;
+	}
+
+	if (strncmp(attr, "scale=", 6) == 0) {
+		err = kstrtoull(attr + 6, 0, &derived->scale);
+		if (!err && derived->scale == 0)
+			err = -ERANGE;
+		return err;
+	}
+
+	if (strncmp(attr, "delta=", 6) == 0) {
+		op = MSR_VREG_DELTA;
+		err = kstrtouint(attr + 6, 0, &derived->in[0]);
+	} else if (strncmp(attr, "rate=", 5) == 0) {
+		op = MSR_VREG_RATE;
+		err = kstrtouint(attr + 5, 0, &derived->in[0]);
+	} else if (strncmp(attr, "ratio=", 6) == 0) {
+		op = MSR_VREG_RATIO;
+		slash = strchr(attr + 6, '/');
+		if (!slash)
+			return -EINVAL;
+		*slash = 0;
+		err = kstrtouint(attr + 6, 0, &derived->in[0]);
+		*slash = '/';
+		if (!err)
+			err = kstrtouint(slash + 1, 0, &derived->in[1]);
+	} else {
+		pr_err("parse_attribute: Unknown attribute %s\n", attr);
+		return -EINVAL;
+	}
+
+	if (derived->op) {
+		pr_err("parse_attribute: More than one derivation: %s\n", attr);
+		return -EINVAL;
+	}
+	derived->op = op;
+	return err;
 }
 
-static int parse_next_whitelist_entry(char *inbuf, char **nextinbuf,
-						struct whitelist_entry *entry)
+/*
+ * Check the attributes of an entry however it was loaded, and fill in
+ * what they imply.
+ */
+static int check_entry(struct whitelist_entry *e)
 {
-	char *s = skip_spaces(inbuf);
-	int i;
-	u64 data[2];
+	struct msr_vreg_derived *d = &e->derived;
+
+	if (e->width && e->last >= MSR_SAFE_ACCUM_LIMIT) {
+		pr_err("check_entry: No accumulator for %llx\n", e->msr);
+		return -EINVAL;
+	}
 
+	if (MSR_SAFE_IS_DERIVED(e->msr) != (d->op != MSR_VREG_NONE) ||
+			(d->op && (e->width || e->wmask)) ||
+			(!d->op && (d->scale || d->in[0] || d->in[1])) ||
+			(MSR_SAFE_IS_VIRT(e->msr) && !d->op) ||
+			(d->op != MSR_VREG_RATIO && d->in[1]) ||
+			d->op > MSR_VREG_RATIO || e->width >= 64 ||
+			e->scope > MSR_WHITELIST_PACKAGE ||
+			(MSR_SAFE_IS_VIRT(e->msr) && e->scope) ||
+			e->last < e->msr || e->last > 0xffffffffULL ||
+			(e->last != e->msr && (d->op ||
+			(e->msr <= VIRT_LAST && e->last >= MSR_SAFE_VIRT_BASE)))) {
+		pr_err("check_entry: Bad entry for %llx\n", e->msr);
+		return -EINVAL;
+	}
+
+	d->msr = e->msr;
+	if (d->op && !d->scale)
+		d->scale = 1;
+	return 0;
+}
+
+static char *skip_comments(char *s)
+{
+	s = skip_spaces(s);
 	while (*s == '#') { /* Skip remaining portion of line */
 		for (s = s + 1; *s && *s != '\n'; s++)
 			;
 		s = skip_spaces(s);
 	}
+	return s;
+}
+
+/*
+ * An entry is an MSR, or a range first-last of MSRs that share a write
+ * mask, then the write mask and any attributes.
+ */
+static int parse_next_whitelist_entry(char *inbuf, char **nextinbuf,
+						struct whitelist_entry *entry)
+{
+	char *s = skip_comments(inbuf);
+	char *dash;
+	int i;
+	u64 data[2];
+	u64 last;
+	unsigned int width;
+	unsigned int scope;
+	struct msr_vreg_derived derived;
+	struct whitelist_entry e;
+	int err;
 
 	if (*s == 0)
 		return 0; /* This means we are done with the input buffer */
@@ -307,21 +1706,110 @@ static int parse_next_whitelist_entry(char *inbuf, char **nextinbuf,
 
 		tmp = *s;
 		*s = 0; /* Null-terminate this portion of string */
-		err = kstrtoull(s2, 0, &data[i]);
+		dash = i == 0 ? strchr(s2, '-') : NULL;
+		if (dash) {
+			*dash = 0;
+			err = kstrtoull(dash + 1, 0, &last);
+		}
+		if (!dash || !err)
+			err = kstrtoull(s2, 0, &data[i]);
+		if (dash)
+			*dash = '-';
 		if (err)
 			return err;
+		if (i == 0 && !dash)
+			last = data[0];
 		*s++ = tmp;
 	}
 
-	if (entry) {
-		entry->msr = data[0];
-		entry->wmask = data[1];
+	/* Optional name=value attributes follow the write mask */
+	memset(&derived, 0, sizeof(derived));
+	for (width = 0, scope = 0; isalpha(*skip_spaces(s)); ) {
+		char *s2;
+		int err;
+		char tmp;
+
+		s2 = s = skip_spaces(s);
+		while (!isspace(*s) && *s)
+			s++;
+
+		tmp = *s;
+		*s = 0; /* Null-terminate this portion of string */
+		err = parse_attribute(s2, &width, &scope, &derived);
+		*s = tmp;
+		if (err)
+			return err;
 	}
 
+	memset(&e, 0, sizeof(e));
+	e.msr = data[0];
+	e.last = last;
+	e.wmask = data[1];
+	e.width = width;
+	e.scope = scope;
+	e.derived = derived;
+	err = check_entry(&e);
+	if (err)
+		return err;
+
+	if (entry)
+		*entry = e;
+
 	*nextinbuf = s; /* Return where we left off to caller */
 	return *nextinbuf - inbuf;
 }
 
+/*
+ * An edit is "+" and then an entry to add, or "-" and then the MSR an
+ * entry to remove starts at.  *remove tells which was parsed.
+ */
+static int parse_next_whitelist_edit(char *inbuf, char **nextinbuf,
+					struct whitelist_entry *entry, int *remove)
+{
+	char *s = skip_comments(inbuf);
+	char *s2;
+	char tmp;
+	u64 msr;
+	int res;
+
+	if (*s == 0)
+		return 0;
+
+	if (*s == '+') {
+		*remove = 0;
+		res = parse_next_whitelist_entry(s + 1, nextinbuf, entry);
+		if (res == 0) {
+			pr_err("parse_next_whitelist_edit: Missing entry\n");
+			return -EINVAL;
+		}
+		return res < 0 ? res : *nextinbuf - inbuf;
+	}
+
+	if (*s != '-') {
+		pr_err("parse_next_whitelist_edit: Edit must start with + or -\n");
+		return -EINVAL;
+	}
+
+	s2 = s = skip_spaces(s + 1);
+	while (!isspace(*s) && *s)
+		s++;
+	tmp = *s;
+	*s = 0; /* Null-terminate this portion of string */
+	res = kstrtoull(s2, 0, &msr);
+	*s = tmp;
+	if (res)
+		return res;
+
+	*remove = 1;
+	if (entry) {
+		memset(entry, 0, sizeof(*entry));
+		entry->msr = msr;
+		entry->last = msr;
+	}
+	*nextinbuf = s;
+	return *nextinbuf - inbuf;
+}
+
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,39)
 static char *msr_whitelist_nodename(struct device *dev, mode_t *mode)
 #else
@@ -334,6 +1822,8 @@ static char *msr_whitelist_nodename(struct device *dev, umode_t *mode)
 void msr_whitelist_cleanup(void)
 {
 	delete_whitelist();
+	free_snapshot(snapshot);
+	snapshot = NULL;
 
 	if (cdev_created) {
 		cdev_created = 0;
@@ -382,5 +1872,55 @@ int msr_whitelist_init(void)
 		return err;
 	}
 	cdev_created = 1;
+
+	if (install_builtin_whitelist())
+		pr_err("msr_whitelist_init: built-in whitelist not installed\n");
 	return 0;
 }
+
+/*
+ * Install the built-in whitelist for the family and model of the boot CPU,
+ * if there is one, so that the devices are usable without a whitelist
+ * being written at boot.  Its records are sorted and checked for overlap
+ * when msr_whitelist_builtin.c is generated, so only the index is built
+ * here.  Any whitelist written later replaces it.
+ */
+static int install_builtin_whitelist(void)
+{
+	const struct msr_whitelist_builtin *b;
+	struct whitelist_table *t;
+	u32 i;
+	int pos = 0;
+	int err = 0;
+
+	if (!builtin_whitelist || boot_cpu_data.x86_vendor != X86_VENDOR_INTEL)
+		return 0;
+
+	for (b = msr_whitelist_builtins; b->records; b++)
+		if (b->family == boot_cpu_data.x86 &&
+				b->model == boot_cpu_data.x86_model)
+			break;
+	if (!b->records)
+		return 0;
+
+	t = create_whitelist(b->nrecords);
+	if (!t)
+		return -ENOMEM;
+	t->builtin = true;	/* Loaded on every node, so wait for a user */
+
+	for (i = 0; i < b->nrecords; i++)
+		record_to_entry(&b->records[i], &t->entries[i]);
+	for (i = 0; !err && i < b->nattrs; i++)
+		err = apply_attr(&b->attrs[i], t->entries, b->nrecords, &pos);
+	for (i = 0; !err && i < b->nrecords; i++)
+		err = check_entry(&t->entries[i]);
+	if (err) {
+		free_whitelist(t);
+		return err;
+	}
+	err = finish_whitelist(t);
+	if (!err)
+		pr_info("msr_whitelist: installed built-in whitelist for %02x_%02x\n",
+							b->family, b->model);
+	return err;
+}
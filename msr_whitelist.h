@@ -12,10 +12,31 @@
 #include <linux/types.h>
 
 int msr_whitelist_init(void);
-int msr_whitelist_cleanup(void);
+void msr_whitelist_cleanup(void);
 int msr_whitelist_exists(void);
+int msr_whitelist_lookup(loff_t reg, u64 *wmask);
 int msr_whitelist_maskexists(loff_t reg);
 u64 msr_whitelist_readmask(loff_t reg);
 u64 msr_whitelist_writemask(loff_t reg);
+u64 msr_whitelist_generation(void);
+
+struct msr_whitelist_record;
+struct msr_whitelist_attr;
+
+/*
+ * Default whitelist of a CPU model, generated from whitelists/wl_FFMM into
+ * msr_whitelist_builtin.c.  msr_whitelist_builtins[] ends with an entry
+ * whose records are NULL.
+ */
+struct msr_whitelist_builtin {
+	u8 family;
+	u8 model;
+	u32 nrecords;
+	u32 nattrs;
+	const struct msr_whitelist_record *records;	/* Sorted by MSR */
+	const struct msr_whitelist_attr *attrs;		/* Sorted, or NULL */
+};
+
+extern const struct msr_whitelist_builtin msr_whitelist_builtins[];
 
 #endif /* _ARCH_X68_KERNEL_MSR_WHITELIST_H */
@@ -0,0 +1,128 @@
+/*
+ * Block index over whitelisted MSR addresses
+ *
+ * Whitelists are mostly runs of nearby MSRs (counter banks, uncore boxes),
+ * so addresses are grouped in aligned blocks of 64, and each block in use
+ * gets a 64-bit presence bitmap in a small open-addressed hash table.  The
+ * write masks are kept in a dense array in address order, so the mask of
+ * an MSR is found at the block's base plus the number of present MSRs
+ * below it in the block.  A lookup usually reads one 16-byte block and
+ * one mask, where a hash chain of whitelist entries would visit several
+ * scattered 40-byte structures.  Ranges of MSRs are not expanded into the
+ * blocks; a lookup that misses the blocks binary searches them instead.
+ */
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#define wlindex_popcount(x) hweight64(x)
+#else
+#define wlindex_popcount(x) __builtin_popcountll(x)
+#endif
+#include "msr_wlindex.h"
+
+#define WLINDEX_UNUSED 0xffffffffu
+#define WLINDEX_BLOCK_MASK ((1u << MSR_WLINDEX_BLOCK_BITS) - 1)
+
+static __u32 wlindex_hash(const struct msr_wlindex *idx, __u32 key)
+{
+	return (key * 0x9e3779b1u) >> idx->hash_shift;
+}
+
+/*
+ * Size of the block table for an index of n MSRs: a power of two that
+ * keeps the table at most half full.
+ */
+int msr_wlindex_nblocks(int n)
+{
+	int size = 2;
+
+	while (size < 2 * n)
+		size *= 2;
+	return size;
+}
+
+/*
+ * Fill idx->blocks from msr[0..n), which must be sorted and free of
+ * duplicates.  The caller fills wmask[] and slot[] in the same order.
+ */
+void msr_wlindex_build(struct msr_wlindex *idx, const __u32 *msr, int n)
+{
+	struct msr_wlindex_block *b = 0;
+	int size = msr_wlindex_nblocks(n);
+	__u32 key;
+	__u32 h;
+	int i;
+
+	for (idx->hash_shift = 32; size > 1; size /= 2)
+		idx->hash_shift--;
+	size = msr_wlindex_nblocks(n);
+	for (i = 0; i < size; i++)
+		idx->blocks[i].key = WLINDEX_UNUSED;
+
+	idx->nused = 0;
+	for (i = 0; i < n; i++) {
+		key = msr[i] >> MSR_WLINDEX_BLOCK_BITS;
+		if (!b || b->key != key) {
+			h = wlindex_hash(idx, key);
+			while (idx->blocks[h].key != WLINDEX_UNUSED)
+				h = (h + 1) & (size - 1);
+			b = &idx->blocks[h];
+			b->key = key;
+			b->base = i;
+			b->present = 0;
+			idx->nused++;
+		}
+		b->present |= 1ULL << (msr[i] & WLINDEX_BLOCK_MASK);
+	}
+}
+
+static int wlindex_lookup_range(const struct msr_wlindex *idx, __u32 msr,
+							__u64 *wmask)
+{
+	const struct msr_wlindex_range *r;
+	int lo = 0;
+	int hi = idx->nranges;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = &idx->ranges[mid];
+		if (msr < r->first) {
+			hi = mid;
+		} else if (msr > r->last) {
+			lo = mid + 1;
+		} else {
+			if (wmask)
+				*wmask = r->wmask;
+			return r->slot;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Return the caller's slot for msr, and its write mask in *wmask if wmask
+ * is not NULL, or -1 if msr is not in the index.
+ */
+int msr_wlindex_lookup(const struct msr_wlindex *idx, __u32 msr,
+							__u64 *wmask)
+{
+	const struct msr_wlindex_block *b;
+	__u32 key = msr >> MSR_WLINDEX_BLOCK_BITS;
+	__u32 bit = msr & WLINDEX_BLOCK_MASK;
+	__u32 mask = 0xffffffffu >> idx->hash_shift;
+	__u32 h = wlindex_hash(idx, key);
+	__u32 pos;
+
+	for (b = &idx->blocks[h]; b->key != key; b = &idx->blocks[h]) {
+		if (b->key == WLINDEX_UNUSED)
+			return wlindex_lookup_range(idx, msr, wmask);
+		h = (h + 1) & mask;
+	}
+	if (!(b->present & (1ULL << bit)))
+		return wlindex_lookup_range(idx, msr, wmask);
+
+	pos = b->base + wlindex_popcount(b->present & ((1ULL << bit) - 1));
+	if (wmask)
+		*wmask = idx->wmask[pos];
+	return idx->slot[pos];
+}
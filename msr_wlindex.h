@@ -0,0 +1,50 @@
+/*
+ * Block index over whitelisted MSR addresses.
+ *
+ * This header and msr_wlindex.c are built both into the module and into
+ * the userspace benchmark, so they use only the __u32/__u64 types.
+ */
+#ifndef _ARCH_X68_KERNEL_MSR_WLINDEX_H
+#define _ARCH_X68_KERNEL_MSR_WLINDEX_H 1
+
+#include <linux/types.h>
+
+#define MSR_WLINDEX_BLOCK_BITS	6	/* 64 MSRs per block */
+
+struct msr_wlindex_block {
+	__u32 key;	/* msr >> MSR_WLINDEX_BLOCK_BITS, or ~0 if unused */
+	__u32 base;	/* Position of the block's lowest MSR in wmask[] */
+	__u64 present;	/* Bit i set if MSR key * 64 + i is indexed */
+};
+
+struct msr_wlindex_range {
+	__u32 first;
+	__u32 last;
+	__u64 wmask;	/* Write mask of every MSR in the range */
+	__u32 slot;	/* Caller's index of the range */
+	__u32 pad;
+};
+
+/*
+ * All arrays are supplied by the caller: blocks[] holds
+ * msr_wlindex_nblocks(n) elements and wmask[] and slot[] hold n elements
+ * in ascending MSR order, for an index of n MSRs.  Runs of MSRs that share
+ * a write mask may instead be given as nranges disjoint ranges[] in
+ * ascending order, none of which holds one of the n MSRs.
+ */
+struct msr_wlindex {
+	__u32 hash_shift;			/* 32 - log2(table size) */
+	__u32 nused;				/* # of blocks in use */
+	struct msr_wlindex_block *blocks;	/* Open-addressed table */
+	__u64 *wmask;				/* Write mask of each MSR */
+	__u32 *slot;				/* Caller's index of each MSR */
+	int nranges;				/* # of ranges */
+	struct msr_wlindex_range *ranges;	/* Sorted by first */
+};
+
+int msr_wlindex_nblocks(int n);
+void msr_wlindex_build(struct msr_wlindex *idx, const __u32 *msr, int n);
+int msr_wlindex_lookup(const struct msr_wlindex *idx, __u32 msr,
+							__u64 *wmask);
+
+#endif /* _ARCH_X68_KERNEL_MSR_WLINDEX_H */
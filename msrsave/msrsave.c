@@ -30,332 +30,1511 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../msr.h"
 #include "msrsave.h"
 
-static int msr_parse_whitelist(const char *whitelist_path, size_t *num_msr_ptr, uint64_t **msr_offset_ptr, uint64_t **msr_mask_ptr)
+/* Names of the MSR_WHITELIST_THREAD etc. scopes in the whitelist enumeration */
+static const char *const msr_scope_name[] = {"thread", "core", "module", "package"};
+
+/* Most ops in one batch request, 256 KiB of struct msr_batch_op */
+#define MSR_BATCH_MAX_OPS 8192
+
+/*
+ * Parse one line of whitelist enumeration, which may name a range of MSRs.
+ * An MSR without a known scope is treated as per thread.
+ */
+static int msr_parse_whitelist_line(const char *line, unsigned long long *first, unsigned long long *last,
+                                    unsigned long long *mask, uint32_t *scope)
+{
+    const char *scope_ptr = strstr(line, " Scope: ");
+    char scope_name[16] = "";
+    uint32_t i;
+
+    if (scope_ptr)
+    {
+        sscanf(scope_ptr, " Scope: %15s", scope_name);
+    }
+    *scope = MSR_WHITELIST_THREAD;
+    for (i = MSR_WHITELIST_CORE; i <= MSR_WHITELIST_PACKAGE; ++i)
+    {
+        if (strcmp(scope_name, msr_scope_name[i]) == 0)
+        {
+            *scope = i;
+        }
+    }
+    if (sscanf(line, "MSR: %llx-%llx Write Mask: %llx", first, last, mask) == 3)
+    {
+        return *first <= *last ? 0 : -1;
+    }
+    if (sscanf(line, "MSR: %llx Write Mask: %llx", first, mask) != 2)
+    {
+        return -1;
+    }
+    *last = *first;
+    return 0;
+}
+
+/* Make room in the parsed whitelist for num_add more MSRs. */
+static int msr_grow_whitelist(size_t num_add, size_t num_msr, size_t *max_msr, uint64_t **msr_offset,
+                              uint64_t **msr_mask, uint32_t **msr_scope)
+{
+    int err = 0;
+    size_t new_max = *max_msr ? *max_msr : 256;
+    uint64_t *tmp_ptr = NULL;
+    uint32_t *tmp_scope = NULL;
+    char err_msg[NAME_MAX];
+
+    if (num_msr + num_add <= *max_msr)
+    {
+        goto exit;
+    }
+    while (new_max < num_msr + num_add)
+    {
+        new_max *= 2;
+    }
+    tmp_ptr = (uint64_t *)realloc(*msr_offset, sizeof(uint64_t) * new_max);
+    if (tmp_ptr)
+    {
+        *msr_offset = tmp_ptr;
+        tmp_ptr = (uint64_t *)realloc(*msr_mask, sizeof(uint64_t) * new_max);
+    }
+    if (tmp_ptr)
+    {
+        *msr_mask = tmp_ptr;
+        tmp_scope = (uint32_t *)realloc(*msr_scope, sizeof(uint32_t) * new_max);
+    }
+    if (!tmp_scope)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Unable to allocate msr offset data of size: %zu!", sizeof(uint64_t) * new_max);
+        perror(err_msg);
+        goto exit;
+    }
+    *msr_scope = tmp_scope;
+    *max_msr = new_max;
+
+exit:
+    return err;
+}
+
+/* Add the MSRs first through last to the parsed whitelist. */
+static int msr_add_whitelist(unsigned long long first, unsigned long long last, unsigned long long mask,
+                             uint32_t scope, size_t *num_msr, size_t *max_msr, uint64_t **msr_offset,
+                             uint64_t **msr_mask, uint32_t **msr_scope)
+{
+    int err = msr_grow_whitelist(last - first + 1, *num_msr, max_msr, msr_offset, msr_mask, msr_scope);
+
+    for (; !err && first <= last; ++first, ++*num_msr)
+    {
+        (*msr_offset)[*num_msr] = first;
+        (*msr_mask)[*num_msr] = mask;
+        (*msr_scope)[*num_msr] = scope;
+    }
+    return err;
+}
+
+struct msr_sort_entry
+{
+    uint64_t offset;
+    uint64_t mask;
+    uint32_t scope;
+};
+
+static int msr_compare_entry(const void *a, const void *b)
+{
+    uint64_t offset_a = ((const struct msr_sort_entry *)a)->offset;
+    uint64_t offset_b = ((const struct msr_sort_entry *)b)->offset;
+
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+/*
+ * Sort the parsed whitelist by MSR offset.  The enumeration lists MSRs in
+ * the order they were written, but a dump and the save file hold them in
+ * ascending order.
+ */
+static int msr_sort_whitelist(size_t num_msr, uint64_t *msr_offset, uint64_t *msr_mask, uint32_t *msr_scope)
+{
+    int err = 0;
+    size_t j;
+    struct msr_sort_entry *entry = NULL;
+    char err_msg[NAME_MAX];
+
+    entry = (struct msr_sort_entry *)malloc(num_msr * sizeof(*entry) + 1);
+    if (!entry)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Unable to allocate %zu whitelist entries!", num_msr);
+        perror(err_msg);
+        goto exit;
+    }
+    for (j = 0; j < num_msr; ++j)
+    {
+        entry[j].offset = msr_offset[j];
+        entry[j].mask = msr_mask[j];
+        entry[j].scope = msr_scope[j];
+    }
+    qsort(entry, num_msr, sizeof(*entry), msr_compare_entry);
+    for (j = 0; j < num_msr; ++j)
+    {
+        msr_offset[j] = entry[j].offset;
+        msr_mask[j] = entry[j].mask;
+        msr_scope[j] = entry[j].scope;
+    }
+
+exit:
+    if (entry)
+    {
+        free(entry);
+    }
+    return err;
+}
+
+/*
+ * Get the whitelist as records and attributes with
+ * X86_IOC_MSR_WHITELIST_DUMP.  Returns ENOTTY if whitelist_fd does not
+ * support it, e.g. if it is a regular file.
+ */
+static int msr_dump_whitelist(int whitelist_fd, const char *whitelist_path, size_t *num_msr,
+                              size_t *max_msr, uint64_t **msr_offset, uint64_t **msr_mask, uint32_t **msr_scope)
+{
+    int err = 0;
+    uint32_t i;
+    uint32_t j;
+    uint32_t scope;
+    struct msr_whitelist_dump dump = {0, 0, NULL, NULL};
+    struct msr_whitelist_record *tmp_ptr = NULL;
+    struct msr_whitelist_attr *tmp_attr = NULL;
+    const struct msr_whitelist_attr *attr = NULL;
+    char err_msg[NAME_MAX];
+
+    /* Ask for the size, then retry in case the whitelist has since grown */
+    while (ioctl(whitelist_fd, X86_IOC_MSR_WHITELIST_DUMP, &dump))
+    {
+        if (errno != ENOSPC)
+        {
+            err = errno ? errno : -1;
+            if (err != ENOTTY)
+            {
+                snprintf(err_msg, NAME_MAX, "Dump of whitelist \"%s\" failed!", whitelist_path);
+                perror(err_msg);
+            }
+            goto exit;
+        }
+        tmp_ptr = (struct msr_whitelist_record *)realloc(dump.records, (dump.nrecords + 1) * sizeof(*tmp_ptr));
+        if (!tmp_ptr)
+        {
+            err = errno ? errno : -1;
+            snprintf(err_msg, NAME_MAX, "Unable to allocate %u whitelist records!", dump.nrecords);
+            perror(err_msg);
+            goto exit;
+        }
+        dump.records = tmp_ptr;
+        tmp_attr = (struct msr_whitelist_attr *)realloc(dump.attrs, (dump.nattrs + 1) * sizeof(*tmp_attr));
+        if (!tmp_attr)
+        {
+            err = errno ? errno : -1;
+            snprintf(err_msg, NAME_MAX, "Unable to allocate %u whitelist attributes!", dump.nattrs);
+            perror(err_msg);
+            goto exit;
+        }
+        dump.attrs = tmp_attr;
+    }
+
+    /* An attribute covers the records from its msr up to its last */
+    for (i = 0, j = 0; !err && i < dump.nrecords; ++i)
+    {
+        while (j < dump.nattrs && dump.records[i].msr > (dump.attrs[j].last ? dump.attrs[j].last : dump.attrs[j].msr))
+        {
+            ++j;
+        }
+        attr = j < dump.nattrs && dump.records[i].msr >= dump.attrs[j].msr ? &dump.attrs[j] : NULL;
+        scope = attr && attr->scope <= MSR_WHITELIST_PACKAGE ? attr->scope : MSR_WHITELIST_THREAD;
+        err = msr_add_whitelist(dump.records[i].msr,
+                                dump.records[i].last ? dump.records[i].last : dump.records[i].msr,
+                                dump.records[i].wmask, scope,
+                                num_msr, max_msr, msr_offset, msr_mask, msr_scope);
+    }
+
+exit:
+    if (dump.attrs)
+    {
+        free(dump.attrs);
+    }
+    if (dump.records)
+    {
+        free(dump.records);
+    }
+    return err;
+}
+
+/*
+ * Read the whitelist enumeration once into a growable buffer and parse it
+ * in a single pass, sorted by MSR offset.  The installed whitelist is
+ * dumped as records instead when the kernel supports it.
+ */
+static int msr_parse_whitelist(const char *whitelist_path, size_t *num_msr_ptr, uint64_t **msr_offset_ptr,
+                               uint64_t **msr_mask_ptr, uint32_t **msr_scope_ptr)
+{
+    enum {BUFFER_SIZE = 8192};
+    int err = 0;
+    int whitelist_fd = -1;
+    size_t num_msr = 0;
+    size_t max_msr = 0;
+    size_t buffer_size = 0;
+    size_t buffer_len = 0;
+    ssize_t num_read = 0;
+    char *whitelist_buffer = NULL;
+    char *whitelist_ptr = NULL;
+    char *next_ptr = NULL;
+    char *tmp_ptr = NULL;
+    unsigned long long range_first = 0;
+    unsigned long long range_last = 0;
+    unsigned long long range_mask = 0;
+    uint32_t range_scope = 0;
+    char err_msg[NAME_MAX];
+
+    *msr_offset_ptr = NULL;
+    *msr_mask_ptr = NULL;
+    *msr_scope_ptr = NULL;
+
+    whitelist_fd = open(whitelist_path, O_RDONLY);
+    if (whitelist_fd == -1)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Open of whitelist file named\"%s\" failed! ", whitelist_path);
+        perror(err_msg);
+        goto exit;
+    }
+
+    err = msr_dump_whitelist(whitelist_fd, whitelist_path, &num_msr, &max_msr, msr_offset_ptr, msr_mask_ptr,
+                             msr_scope_ptr);
+    if (err != ENOTTY)
+    {
+        goto check;
+    }
+    err = 0;
+
+    do
+    {
+        if (buffer_size - buffer_len < BUFFER_SIZE + 1)
+        {
+            buffer_size = buffer_size ? 2 * buffer_size : 2 * BUFFER_SIZE;
+            tmp_ptr = (char *)realloc(whitelist_buffer, buffer_size);
+            if (!tmp_ptr)
+            {
+                err = errno ? errno : -1;
+                snprintf(err_msg, NAME_MAX, "Could not allocate array of size %zu!", buffer_size);
+                perror(err_msg);
+                goto exit;
+            }
+            whitelist_buffer = tmp_ptr;
+        }
+        num_read = read(whitelist_fd, whitelist_buffer + buffer_len, BUFFER_SIZE);
+        if (num_read == -1)
+        {
+            err = errno ? errno : -1;
+            snprintf(err_msg, NAME_MAX, "Read of whitelist file \"%s\" failed! ", whitelist_path);
+            perror(err_msg);
+            goto exit;
+        }
+        buffer_len += num_read;
+    }
+    while (num_read);
+    whitelist_buffer[buffer_len] = '\0';
+
+    /* Parse each complete line, a range line holds several MSRs */
+    whitelist_ptr = whitelist_buffer;
+    for (; !err && (next_ptr = strchr(whitelist_ptr, '\n')); whitelist_ptr = next_ptr + 1)
+    {
+        *next_ptr = '\0';
+        if (msr_parse_whitelist_line(whitelist_ptr, &range_first, &range_last, &range_mask, &range_scope))
+        {
+            err = -1;
+            fprintf(stderr, "Error: Failed to parse whitelist file named \"%s\"\n", whitelist_path);
+            goto exit;
+        }
+        err = msr_add_whitelist(range_first, range_last, range_mask, range_scope,
+                                &num_msr, &max_msr, msr_offset_ptr, msr_mask_ptr, msr_scope_ptr);
+    }
+    if (!err)
+    {
+        err = msr_sort_whitelist(num_msr, *msr_offset_ptr, *msr_mask_ptr, *msr_scope_ptr);
+    }
+
+check:
+    if (!err && num_msr == 0)
+    {
+        err = -1;
+        fprintf(stderr, "Error: Whitelist file (%s) is empty!\n", whitelist_path);
+    }
+
+exit:
+    if (whitelist_fd != -1)
+    {
+        close(whitelist_fd);
+    }
+    if (whitelist_buffer)
+    {
+        free(whitelist_buffer);
+    }
+    *num_msr_ptr = err ? 0 : num_msr;
+    return err;
+}
+
+/* Open the batch device, or return -1 to fall back to the per-CPU files. */
+static int msr_batch_open(const char *msr_batch_path)
+{
+    int batch_fd = -1;
+
+    if (msr_batch_path)
+    {
+        batch_fd = open(msr_batch_path, O_RDWR);
+    }
+    return batch_fd;
+}
+
+/*
+ * Submit ops as X86_IOC_MSR_BATCH requests of at most MSR_BATCH_MAX_OPS ops,
+ * which the kernel copies into one allocation each.  ENOMEM is returned
+ * without a message so that the caller can fall back to the per-CPU files.
+ */
+static int msr_batch_run(int batch_fd, const char *msr_batch_path, struct msr_batch_op *ops, size_t num_ops)
+{
+    int err = 0;
+    size_t i;
+    size_t num_run;
+    char err_msg[NAME_MAX];
+    struct msr_batch_array batch;
+
+    for (; !err && num_ops; ops += num_run, num_ops -= num_run)
+    {
+        num_run = num_ops < MSR_BATCH_MAX_OPS ? num_ops : MSR_BATCH_MAX_OPS;
+        batch.numops = num_run;
+        batch.ops = ops;
+        if (ioctl(batch_fd, X86_IOC_MSR_BATCH, &batch))
+        {
+            err = errno ? errno : -1;
+            if (err == ENOMEM)
+            {
+                break;
+            }
+            for (i = 0; i < num_run && !ops[i].err; ++i);
+            if (i < num_run)
+            {
+                snprintf(err_msg, NAME_MAX, "Batch %s of MSR 0x%x on CPU %d through \"%s\" failed!",
+                         ops[i].isrdmsr ? "read" : "write", ops[i].msr, ops[i].cpu, msr_batch_path);
+            }
+            else
+            {
+                snprintf(err_msg, NAME_MAX, "Batch request to \"%s\" failed!", msr_batch_path);
+            }
+            perror(err_msg);
+        }
+    }
+    return err;
+}
+
+static int msr_read_cpu(const char *msr_path_format, int cpu, size_t num_msr, const uint64_t *msr_offset,
+                        uint64_t *buffer, const char *do_read)
+{
+    int err = 0;
+    int msr_fd = -1;
+    size_t j;
+    char err_msg[NAME_MAX];
+    char msr_file_name[NAME_MAX];
+
+    for (j = 0; j < num_msr && !do_read[j]; ++j);
+    if (j == num_msr)
+    {
+        goto exit;
+    }
+    snprintf(msr_file_name, NAME_MAX, msr_path_format, cpu);
+    msr_fd = open(msr_file_name, O_RDWR);
+    if (msr_fd == -1)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Could not open MSR file \"%s\"!", msr_file_name);
+        perror(err_msg);
+        goto exit;
+    }
+    for (; j < num_msr; ++j)
+    {
+        if (do_read[j] &&
+            pread(msr_fd, buffer + j, sizeof(uint64_t), msr_offset[j]) != sizeof(uint64_t))
+        {
+            err = errno ? errno : -1;
+            snprintf(err_msg, NAME_MAX, "Failed to read msr value from MSR file \"%s\"!", msr_file_name);
+            perror(err_msg);
+            goto exit;
+        }
+    }
+    if (close(msr_fd))
+    {
+        msr_fd = -1;
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Could not close MSR file \"%s\"!", msr_file_name);
+        perror(err_msg);
+        goto exit;
+    }
+    msr_fd = -1;
+
+exit:
+    if (msr_fd != -1)
+    {
+        close(msr_fd);
+    }
+    return err;
+}
+
+/* Write the MSRs of one CPU that have do_write set through its msr_safe file. */
+static int msr_write_cpu(const char *msr_path_format, int cpu, size_t num_msr, const uint64_t *msr_offset,
+                         const uint64_t *write_buffer, const char *do_write)
+{
+    int err = 0;
+    int msr_fd = -1;
+    size_t j;
+    char err_msg[NAME_MAX];
+    char msr_file_name[NAME_MAX];
+
+    for (j = 0; j < num_msr && !do_write[j]; ++j);
+    if (j == num_msr)
+    {
+        goto exit;
+    }
+    snprintf(msr_file_name, NAME_MAX, msr_path_format, cpu);
+    msr_fd = open(msr_file_name, O_RDWR);
+    if (msr_fd == -1)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Could not open MSR file \"%s\"!", msr_file_name);
+        perror(err_msg);
+        goto exit;
+    }
+    for (; j < num_msr; ++j)
+    {
+        if (do_write[j] &&
+            pwrite(msr_fd, write_buffer + j, sizeof(uint64_t), msr_offset[j]) != sizeof(uint64_t))
+        {
+            err = errno ? errno : -1;
+            snprintf(err_msg, NAME_MAX, "Failed to write msr value at offset 0x%016llx to MSR file \"%s\"!",
+                     (unsigned long long)msr_offset[j], msr_file_name);
+            perror(err_msg);
+            goto exit;
+        }
+    }
+    if (close(msr_fd))
+    {
+        msr_fd = -1;
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Could not close MSR file \"%s\"!", msr_file_name);
+        perror(err_msg);
+        goto exit;
+    }
+    msr_fd = -1;
+
+exit:
+    if (msr_fd != -1)
+    {
+        close(msr_fd);
+    }
+    return err;
+}
+
+struct msr_cpu_task
+{
+    const char *msr_path_format;
+    int cpu;
+    size_t num_msr;
+    const uint64_t *msr_offset;
+    uint64_t *buffer;       /* Slice of the CPU, read into or written from */
+    const char *do_access;  /* Slice of the CPU, MSRs to read or write */
+    int is_write;
+    int err;
+};
+
+static void *msr_cpu_worker(void *arg)
+{
+    struct msr_cpu_task *task = (struct msr_cpu_task *)arg;
+    cpu_set_t cpu_set;
+
+    /* Run on the target CPU so its MSRs are accessed without an IPI.
+       Failure is harmless, e.g. for the mock MSR files of the test. */
+    if (task->cpu < CPU_SETSIZE)
+    {
+        CPU_ZERO(&cpu_set);
+        CPU_SET(task->cpu, &cpu_set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+    if (task->is_write)
+    {
+        task->err = msr_write_cpu(task->msr_path_format, task->cpu, task->num_msr, task->msr_offset,
+                                  task->buffer, task->do_access);
+    }
+    else
+    {
+        task->err = msr_read_cpu(task->msr_path_format, task->cpu, task->num_msr, task->msr_offset,
+                                 task->buffer, task->do_access);
+    }
+    return NULL;
+}
+
+/*
+ * Read or write the MSRs that have do_access set on each CPU in cpu_id
+ * through the msr_safe files, with one worker thread per CPU pinned to that CPU.  Each worker
+ * fills or drains only its own CPU's slice of buffer, so the result is the
+ * same as going through the CPUs in turn.  A CPU whose thread cannot be
+ * created is done by the calling thread.
+ */
+static int msr_run_cpus(const char *msr_path_format, const int *cpu_id, int num_cpu, size_t num_msr,
+                        const uint64_t *msr_offset, uint64_t *buffer, const char *do_access, int is_write)
+{
+    int err = 0;
+    int i;
+    struct msr_cpu_task *task = NULL;
+    pthread_t *thread = NULL;
+    char *is_started = NULL;
+    char err_msg[NAME_MAX];
+
+    task = (struct msr_cpu_task *)calloc(num_cpu, sizeof(struct msr_cpu_task));
+    thread = (pthread_t *)calloc(num_cpu, sizeof(pthread_t));
+    is_started = (char *)calloc(num_cpu, sizeof(char));
+    if (!task || !thread || !is_started)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Unable to allocate %d worker threads!", num_cpu);
+        perror(err_msg);
+        goto exit;
+    }
+
+    for (i = 0; i < num_cpu; ++i)
+    {
+        task[i].msr_path_format = msr_path_format;
+        task[i].cpu = cpu_id[i];
+        task[i].num_msr = num_msr;
+        task[i].msr_offset = msr_offset;
+        task[i].buffer = buffer + i * num_msr;
+        task[i].do_access = do_access + i * num_msr;
+        task[i].is_write = is_write;
+        is_started[i] = pthread_create(thread + i, NULL, msr_cpu_worker, task + i) == 0;
+        if (!is_started[i])
+        {
+            msr_cpu_worker(task + i);
+        }
+    }
+    for (i = 0; i < num_cpu; ++i)
+    {
+        if (is_started[i])
+        {
+            pthread_join(thread[i], NULL);
+        }
+        if (!err)
+        {
+            err = task[i].err;
+        }
+    }
+
+exit:
+    if (task)
+    {
+        free(task);
+    }
+    if (thread)
+    {
+        free(thread);
+    }
+    if (is_started)
+    {
+        free(is_started);
+    }
+    return err;
+}
+
+/*
+ * Read each MSR that has do_read set on each CPU in cpu_id into buffer, a
+ * 2-D array over CPU and then msr offset, with batch requests if batch_fd
+ * is open and the kernel can allocate them, else one pread per MSR from a
+ * worker on each CPU.
+ */
+static int msr_read_all(int batch_fd, const char *msr_batch_path, const char *msr_path_format,
+                        const int *cpu_id, int num_cpu, size_t num_msr, const uint64_t *msr_offset,
+                        uint64_t *buffer, const char *do_read)
+{
+    int err = 0;
+    int i;
+    size_t j;
+    size_t num_ops = 0;
+    struct msr_batch_op *ops = NULL;
+    char err_msg[NAME_MAX];
+
+    if (batch_fd == -1)
+    {
+        err = msr_run_cpus(msr_path_format, cpu_id, num_cpu, num_msr, msr_offset, buffer, do_read, 0);
+        goto exit;
+    }
+
+    for (j = 0; j < num_msr * num_cpu; ++j)
+    {
+        num_ops += do_read[j] ? 1 : 0;
+    }
+
+    ops = (struct msr_batch_op *)calloc(num_ops + 1, sizeof(struct msr_batch_op));
+    if (!ops)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Unable to allocate batch of size: %zu!", num_ops * sizeof(struct msr_batch_op));
+        perror(err_msg);
+        goto exit;
+    }
+    num_ops = 0;
+    for (i = 0; i < num_cpu; ++i)
+    {
+        for (j = 0; j < num_msr; ++j)
+        {
+            if (do_read[i * num_msr + j])
+            {
+                ops[num_ops].cpu = cpu_id[i];
+                ops[num_ops].isrdmsr = 1;
+                ops[num_ops].msr = msr_offset[j];
+                ++num_ops;
+            }
+        }
+    }
+    err = msr_batch_run(batch_fd, msr_batch_path, ops, num_ops);
+    if (err == ENOMEM)
+    {
+        err = msr_run_cpus(msr_path_format, cpu_id, num_cpu, num_msr, msr_offset, buffer, do_read, 0);
+        goto exit;
+    }
+    for (j = 0, num_ops = 0; !err && j < num_msr * num_cpu; ++j)
+    {
+        if (do_read[j])
+        {
+            buffer[j] = ops[num_ops].msrdata;
+            ++num_ops;
+        }
+    }
+
+exit:
+    if (ops)
+    {
+        free(ops);
+    }
+    return err;
+}
+
+/*
+ * Write write_buffer, laid out as for msr_read_all(), to each MSR that has
+ * do_write set, with batch requests if batch_fd is open and the kernel can
+ * allocate them, else from a worker on each CPU.
+ */
+static int msr_write_all(int batch_fd, const char *msr_batch_path, const char *msr_path_format,
+                         const int *cpu_id, int num_cpu, size_t num_msr, const uint64_t *msr_offset,
+                         const uint64_t *write_buffer, const char *do_write)
+{
+    int err = 0;
+    int i;
+    size_t j;
+    size_t num_ops = 0;
+    struct msr_batch_op *ops = NULL;
+    char err_msg[NAME_MAX];
+
+    if (batch_fd == -1)
+    {
+        err = msr_run_cpus(msr_path_format, cpu_id, num_cpu, num_msr, msr_offset, (uint64_t *)write_buffer,
+                           do_write, 1);
+        goto exit;
+    }
+
+    for (j = 0; j < num_msr * num_cpu; ++j)
+    {
+        num_ops += do_write[j] ? 1 : 0;
+    }
+    ops = (struct msr_batch_op *)calloc(num_ops + 1, sizeof(struct msr_batch_op));
+    if (!ops)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Unable to allocate batch of size: %zu!", num_ops * sizeof(struct msr_batch_op));
+        perror(err_msg);
+        goto exit;
+    }
+    num_ops = 0;
+    for (i = 0; i < num_cpu; ++i)
+    {
+        for (j = 0; j < num_msr; ++j)
+        {
+            if (do_write[i * num_msr + j])
+            {
+                ops[num_ops].cpu = cpu_id[i];
+                ops[num_ops].msr = msr_offset[j];
+                ops[num_ops].msrdata = write_buffer[i * num_msr + j];
+                ++num_ops;
+            }
+        }
+    }
+    err = msr_batch_run(batch_fd, msr_batch_path, ops, num_ops);
+    if (err == ENOMEM)
+    {
+        err = msr_run_cpus(msr_path_format, cpu_id, num_cpu, num_msr, msr_offset, (uint64_t *)write_buffer,
+                           do_write, 1);
+    }
+
+exit:
+    if (ops)
+    {
+        free(ops);
+    }
+    return err;
+}
+
+/*
+ * Find the index in cpu_id of the CPU that accesses MSRs of each scope on
+ * behalf of each CPU: the first CPU in cpu_id that shares the CPU's core,
+ * module or package as given by the topology under cpu_sysfs_path, e.g.
+ * "/sys/devices/system/cpu".  scope_rep is a 2-D
+ * array over scope and then CPU index.  The topology is only read for the
+ * scopes in msr_scope, and a CPU whose topology cannot be read accesses its
+ * own MSRs.
+ */
+static int msr_scope_domains(const char *cpu_sysfs_path, const int *cpu_id, int num_cpu, size_t num_msr,
+                             const uint32_t *msr_scope, int *scope_rep)
+{
+    /* Lists of the CPUs that share a core, module and package */
+    static const char *const domain_file[] = {NULL, "topology/thread_siblings_list",
+                                              "topology/cluster_cpus_list", "topology/core_siblings_list"};
+    int err = 0;
+    int i;
+    int k;
+    size_t j;
+    uint32_t scope;
+    int *domain = NULL;
+    FILE *domain_fid = NULL;
+    char err_msg[NAME_MAX];
+    char domain_file_name[NAME_MAX];
+
+    domain = (int *)malloc(num_cpu * sizeof(int) + 1);
+    if (!domain)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Unable to allocate topology of %d CPUs!", num_cpu);
+        perror(err_msg);
+        goto exit;
+    }
+    for (scope = MSR_WHITELIST_THREAD; scope <= MSR_WHITELIST_PACKAGE; ++scope)
+    {
+        for (j = 0; j < num_msr && msr_scope[j] != scope; ++j);
+        /* Name each domain by the first CPU in its list */
+        for (i = 0; i < num_cpu; ++i)
+        {
+            domain[i] = cpu_id[i];
+            if (domain_file[scope] && j < num_msr)
+            {
+                snprintf(domain_file_name, NAME_MAX, "%s/cpu%d/%s", cpu_sysfs_path, cpu_id[i],
+                         domain_file[scope]);
+                domain_fid = fopen(domain_file_name, "r");
+                if (domain_fid)
+                {
+                    if (fscanf(domain_fid, "%d", domain + i) != 1)
+                    {
+                        domain[i] = cpu_id[i];
+                    }
+                    fclose(domain_fid);
+                }
+            }
+            for (k = 0; domain[k] != domain[i]; ++k);
+            scope_rep[scope * num_cpu + i] = k;
+        }
+    }
+
+exit:
+    if (domain)
+    {
+        free(domain);
+    }
+    return err;
+}
+
+/*
+ * Set do_access for the MSRs that each CPU accesses on behalf of its
+ * domain of the MSR's scope.
+ */
+static void msr_scope_access(int num_cpu, size_t num_msr, const uint32_t *msr_scope, const int *scope_rep,
+                             char *do_access)
+{
+    int i;
+    size_t j;
+
+    for (i = 0; i < num_cpu; ++i)
+    {
+        for (j = 0; j < num_msr; ++j)
+        {
+            do_access[i * num_msr + j] = scope_rep[msr_scope[j] * num_cpu + i] == i;
+        }
+    }
+}
+
+/*
+ * Copy the values in buffer, laid out as for msr_read_all(), that were read
+ * on behalf of a domain to the other CPUs of the domain.
+ */
+static void msr_scope_fill(int num_cpu, size_t num_msr, const uint32_t *msr_scope, const int *scope_rep,
+                           uint64_t *buffer)
+{
+    int i;
+    size_t j;
+
+    for (i = 0; i < num_cpu; ++i)
+    {
+        for (j = 0; j < num_msr; ++j)
+        {
+            buffer[i * num_msr + j] = buffer[scope_rep[msr_scope[j] * num_cpu + i] * num_msr + j];
+        }
+    }
+}
+
+/* CPUs and MSRs to save or restore, each as a list of first, last pairs */
+struct msr_filter
+{
+    size_t num_online;
+    uint64_t *online;   /* CPUs in the sysfs online list */
+    size_t num_cpu;
+    uint64_t *cpu;      /* CPUs in cpu_list, none for all */
+    size_t num_msr;
+    uint64_t *msr;      /* MSRs in msr_list, none for all */
+};
+
+/*
+ * Parse a list such as "0-27,56-83" of numbers in the given base into
+ * first, last pairs.  A trailing newline, as in sysfs, is allowed.
+ */
+static int msr_parse_list(const char *list, int base, const char *list_name, size_t *num_range_ptr,
+                          uint64_t **range_ptr)
+{
+    int err = 0;
+    size_t num_range = 1;
+    const char *list_ptr = list;
+    char *end_ptr = NULL;
+    char err_msg[NAME_MAX];
+
+    for (; *list_ptr; ++list_ptr)
+    {
+        num_range += *list_ptr == ',' ? 1 : 0;
+    }
+    *range_ptr = (uint64_t *)malloc(2 * num_range * sizeof(uint64_t));
+    if (!*range_ptr)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Unable to allocate %zu ranges of %s!", num_range, list_name);
+        perror(err_msg);
+        goto exit;
+    }
+    num_range = 0;
+    list_ptr = list;
+    do
+    {
+        errno = 0;
+        (*range_ptr)[2 * num_range] = strtoull(list_ptr, &end_ptr, base);
+        (*range_ptr)[2 * num_range + 1] = (*range_ptr)[2 * num_range];
+        if (!errno && end_ptr != list_ptr && *end_ptr == '-')
+        {
+            list_ptr = end_ptr + 1;
+            (*range_ptr)[2 * num_range + 1] = strtoull(list_ptr, &end_ptr, base);
+        }
+        if (errno || end_ptr == list_ptr || *list_ptr == '-' ||
+            (*range_ptr)[2 * num_range] > (*range_ptr)[2 * num_range + 1] ||
+            (*end_ptr != ',' && *end_ptr != '\0' && strcmp(end_ptr, "\n") != 0))
+        {
+            err = -1;
+            fprintf(stderr, "Error: Failed to parse %s \"%s\"\n", list_name, list);
+            goto exit;
+        }
+        ++num_range;
+        list_ptr = end_ptr + 1;
+    }
+    while (*end_ptr == ',');
+    *num_range_ptr = num_range;
+
+exit:
+    if (err && *range_ptr)
+    {
+        free(*range_ptr);
+        *range_ptr = NULL;
+    }
+    return err;
+}
+
+/* Return whether value is in the list of first, last pairs, or the list is empty. */
+static int msr_in_list(uint64_t value, size_t num_range, const uint64_t *range)
+{
+    size_t i;
+
+    for (i = 0; i < num_range && (value < range[2 * i] || value > range[2 * i + 1]); ++i);
+    return num_range == 0 || i < num_range;
+}
+
+/*
+ * Parse the online CPUs listed under cpu_sysfs_path and the cpu_list and
+ * msr_list filters, which may be NULL.
+ */
+static int msr_open_filter(const char *cpu_sysfs_path, const char *cpu_list, const char *msr_list,
+                           struct msr_filter *filter)
+{
+    int err = 0;
+    FILE *online_fid = NULL;
+    char *online_list = NULL;
+    size_t online_size = 0;
+    char err_msg[NAME_MAX];
+    char cpu_online_path[NAME_MAX];
+
+    memset(filter, 0, sizeof(*filter));
+    snprintf(cpu_online_path, NAME_MAX, "%s/online", cpu_sysfs_path);
+    online_fid = fopen(cpu_online_path, "r");
+    if (!online_fid || getline(&online_list, &online_size, online_fid) == -1)
+    {
+        err = errno ? errno : -1;
+        snprintf(err_msg, NAME_MAX, "Could not read online CPUs from \"%s\"!", cpu_online_path);
+        perror(err_msg);
+        goto exit;
+    }
+    err = msr_parse_list(online_list, 10, "online CPUs", &filter->num_online, &filter->online);
+    if (!err && cpu_list)
+    {
+        err = msr_parse_list(cpu_list, 10, "CPU list", &filter->num_cpu, &filter->cpu);
+    }
+    if (!err && msr_list)
+    {
+        err = msr_parse_list(msr_list, 0, "MSR list", &filter->num_msr, &filter->msr);
+    }
+
+exit:
+    if (online_fid)
+    {
+        fclose(online_fid);
+    }
+    if (online_list)
+    {
+        free(online_list);
+    }
+    return err;
+}
+
+static void msr_close_filter(struct msr_filter *filter)
+{
+    if (filter->online)
+    {
+        free(filter->online);
+    }
+    if (filter->cpu)
+    {
+        free(filter->cpu);
+    }
+    if (filter->msr)
+    {
+        free(filter->msr);
+    }
+}
+
+/* Return whether cpu is online and selected by the filter. */
+static int msr_filter_cpu(const struct msr_filter *filter, uint64_t cpu)
+{
+    return msr_in_list(cpu, filter->num_online, filter->online) &&
+           msr_in_list(cpu, filter->num_cpu, filter->cpu);
+}
+
+/*
+ * Save file layout, in host byte order:
+ *
+ *     struct msr_save_header
+ *     uint32_t cpu_id[num_cpu]             CPUs saved, padded to 8 bytes
+ *     struct msr_save_msr msr[num_msr]     MSRs with a non-zero write mask and their scope
+ *     struct msr_save_run run[num_run]     Saved values
+ *
+ * Values are run-length encoded across CPUs: a run gives the value of
+ * msr[msr_index] on cpu_id[cpu_index] and on each later CPU up to the next
+ * run of the same MSR.  Runs are sorted by MSR and then CPU, and each MSR
+ * has a run starting at CPU index 0.  checksum is the 64-bit FNV-1a hash of
+ * everything after the header.
+ */
+#define MSR_SAVE_MAGIC 0x5641534DU  /* "MSAV" */
+#define MSR_SAVE_VERSION 1
+
+struct msr_save_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_cpu;
+    uint32_t num_msr;
+    uint64_t num_run;
+    uint64_t checksum;
+};
+
+struct msr_save_msr
+{
+    uint64_t offset;
+    uint64_t mask;
+    uint32_t scope;     /* MSR_WHITELIST_THREAD etc. */
+    uint32_t pad;
+};
+
+struct msr_save_run
+{
+    uint32_t msr_index;
+    uint32_t cpu_index;
+    uint64_t value;
+};
+
+static uint64_t msr_save_hash(uint64_t hash, const void *buffer, size_t size)
+{
+    const unsigned char *byte = (const unsigned char *)buffer;
+    size_t i;
+
+    for (i = 0; i < size; ++i)
+    {
+        hash = (hash ^ byte[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static size_t msr_save_cpu_size(uint32_t num_cpu)
+{
+    return ((num_cpu + 1) & ~1U) * sizeof(uint32_t);
+}
+
+/*
+ * Write the masked values in save_buffer, a 2-D array over CPU and then MSR
+ * as filled by msr_read_all(), to save_path.
+ */
+static int msr_write_snapshot(const char *save_path, const int *cpu_id, int num_cpu, size_t num_msr,
+                              const uint64_t *msr_offset, const uint64_t *msr_mask, const uint32_t *msr_scope,
+                              const uint64_t *save_buffer)
 {
-    enum {BUFFER_SIZE = 8192};
     int err = 0;
-    int tmp_err = 0;
     int i;
-    int tmp_fd = -1;
-    int whitelist_fd = -1;
-    size_t num_scan = 0;
-    size_t num_msr = 0;
-    ssize_t num_read = 0;
-    ssize_t num_write = 0;
-    char *whitelist_buffer = NULL;
-    char *whitelist_ptr = NULL;
-    uint64_t *msr_offset = NULL;
-    uint64_t *msr_mask = NULL;
-    struct stat whitelist_stat;
-    char tmp_path[NAME_MAX] = "/tmp/msrsave_whitelist_XXXXXX";
+    size_t j;
+    size_t cpu_size = msr_save_cpu_size(num_cpu);
+    struct msr_save_header header = {MSR_SAVE_MAGIC, MSR_SAVE_VERSION, num_cpu, num_msr, 0, 0};
+    uint32_t *save_cpu = NULL;
+    struct msr_save_msr *save_msr = NULL;
+    struct msr_save_run *save_run = NULL;
+    FILE *save_fid = NULL;
     char err_msg[NAME_MAX];
-    char copy_buffer[BUFFER_SIZE];
 
-    /* Copy whitelist into temporary file */
-    tmp_fd = mkstemp(tmp_path);
-    if (tmp_fd == -1)
+    save_cpu = (uint32_t *)calloc(1, cpu_size + 1);
+    save_msr = (struct msr_save_msr *)calloc(num_msr + 1, sizeof(struct msr_save_msr));
+    save_run = (struct msr_save_run *)calloc(num_msr * num_cpu + 1, sizeof(struct msr_save_run));
+    if (!save_cpu || !save_msr || !save_run)
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Creation of temporary file named\"%s\" failed! ", tmp_path);
+        snprintf(err_msg, NAME_MAX, "Unable to allocate msr save state buffer of size: %zu!",
+                 num_msr * num_cpu * sizeof(struct msr_save_run));
         perror(err_msg);
         goto exit;
     }
 
-    whitelist_fd = open(whitelist_path, O_RDONLY);
-    if (whitelist_fd == -1)
+    for (i = 0; i < num_cpu; ++i)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Open of whitelist file named\"%s\" failed! ", whitelist_path);
-        perror(err_msg);
-        goto exit;
+        save_cpu[i] = cpu_id[i];
     }
-
-    while ((num_read = read(whitelist_fd, copy_buffer, sizeof(copy_buffer))))
+    for (j = 0; j < num_msr; ++j)
     {
-        if (num_read == -1)
-        {
-            err = errno ? errno : -1;
-            snprintf(err_msg, NAME_MAX, "Read of whitelist file \"%s\" failed! ", whitelist_path);
-            perror(err_msg);
-            goto exit;
-        }
-
-        num_write = write(tmp_fd, copy_buffer, num_read);
-        if (num_write != num_read)
+        save_msr[j].offset = msr_offset[j];
+        save_msr[j].mask = msr_mask[j];
+        save_msr[j].scope = msr_scope[j];
+        for (i = 0; i < num_cpu; ++i)
         {
-            err = errno ? errno : -1;
-            snprintf(err_msg, NAME_MAX, "Write to temporary file \"%s\" failed! ", tmp_path);
-            perror(err_msg);
-            goto exit;
+            if (i == 0 || save_buffer[i * num_msr + j] != save_buffer[(i - 1) * num_msr + j])
+            {
+                save_run[header.num_run].msr_index = j;
+                save_run[header.num_run].cpu_index = i;
+                save_run[header.num_run].value = save_buffer[i * num_msr + j];
+                ++header.num_run;
+            }
         }
     }
+    header.checksum = msr_save_hash(0xCBF29CE484222325ULL, save_cpu, cpu_size);
+    header.checksum = msr_save_hash(header.checksum, save_msr, num_msr * sizeof(struct msr_save_msr));
+    header.checksum = msr_save_hash(header.checksum, save_run, header.num_run * sizeof(struct msr_save_run));
 
-    tmp_err = close(tmp_fd);
-    tmp_fd = -1;
-    if (tmp_err == -1)
+    save_fid = fopen(save_path, "w");
+    if (!save_fid)
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Close of temporary file named\"%s\" failed! ", tmp_path);
+        snprintf(err_msg, NAME_MAX, "Could not open output file \"%s\"!", save_path);
         perror(err_msg);
         goto exit;
     }
-
-    tmp_err = close(whitelist_fd);
-    whitelist_fd = -1;
-    if (tmp_err == -1)
+    if (fwrite(&header, sizeof(header), 1, save_fid) != 1 ||
+        fwrite(save_cpu, 1, cpu_size, save_fid) != cpu_size ||
+        fwrite(save_msr, sizeof(struct msr_save_msr), num_msr, save_fid) != num_msr ||
+        fwrite(save_run, sizeof(struct msr_save_run), header.num_run, save_fid) != header.num_run)
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Close of whitelist file named\"%s\" failed! ", whitelist_path);
+        snprintf(err_msg, NAME_MAX, "Could not write all values to output file \"%s\"!", save_path);
         perror(err_msg);
         goto exit;
     }
-
-    *msr_offset_ptr = NULL;
-    *msr_mask_ptr = NULL;
-
-    /* Figure out how big the whitelist file is */
-    tmp_err = stat(tmp_path, &whitelist_stat);
-    if (tmp_err != 0)
+    err = fclose(save_fid);
+    save_fid = NULL;
+    if (err)
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "stat() of %s failed! ", tmp_path);
+        snprintf(err_msg, NAME_MAX, "Could not close MSR file \"%s\"!", save_path);
         perror(err_msg);
         goto exit;
     }
 
-    if (whitelist_stat.st_size == 0)
+exit:
+    if (save_fid)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Whitelist file (%s) size is zero!", tmp_path);
-        perror(err_msg);
-        goto exit;
+        fclose(save_fid);
+    }
+    if (save_cpu)
+    {
+        free(save_cpu);
+    }
+    if (save_msr)
+    {
+        free(save_msr);
     }
+    if (save_run)
+    {
+        free(save_run);
+    }
+    return err;
+}
+
+/*
+ * Map restore_path and check it, then expand the CPUs and MSRs in it that
+ * filter selects into the CPUs, MSRs, masks, scopes and the 2-D array of
+ * values over CPU and then MSR that msr_restore() needs.  Fails without
+ * touching any MSR if the file is not a complete snapshot of this version.
+ */
+static int msr_read_snapshot(const char *restore_path, const struct msr_filter *filter, int **cpu_id_ptr,
+                             int *num_cpu_ptr, size_t *num_msr_ptr, uint64_t **msr_offset_ptr,
+                             uint64_t **msr_mask_ptr, uint32_t **msr_scope_ptr, uint64_t **restore_buffer_ptr)
+{
+    int err = 0;
+    int restore_fd = -1;
+    int num_cpu = 0;
+    size_t num_msr = 0;
+    size_t i;
+    size_t size = 0;
+    size_t cpu_size = 0;
+    void *map = MAP_FAILED;
+    struct stat restore_stat;
+    const struct msr_save_header *header = NULL;
+    const uint32_t *save_cpu = NULL;
+    const struct msr_save_msr *save_msr = NULL;
+    const struct msr_save_run *save_run = NULL;
+    const struct msr_save_run *run = NULL;
+    uint32_t next_msr = 0;
+    uint32_t cpu_index = 0;
+    int *cpu_map = NULL;
+    long *msr_map = NULL;
+    char err_msg[NAME_MAX];
 
-    /* Allocate buffer for file contents */
-    whitelist_buffer = (char*)malloc(whitelist_stat.st_size);
-    if (!whitelist_buffer)
+    restore_fd = open(restore_path, O_RDONLY);
+    if (restore_fd == -1 || fstat(restore_fd, &restore_stat))
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not allocate array of size %zu!", whitelist_stat.st_size);
+        snprintf(err_msg, NAME_MAX, "Could not open restore file \"%s\"!", restore_path);
         perror(err_msg);
         goto exit;
     }
-
-    /* Open file */
-    tmp_fd = open(tmp_path, O_RDONLY);
-    if (tmp_fd == -1)
+    size = restore_stat.st_size;
+    if (size >= sizeof(*header))
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not open whitelist temporary file \"%s\"!", tmp_path);
-        perror(err_msg);
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, restore_fd, 0);
+        if (map == MAP_FAILED)
+        {
+            err = errno ? errno : -1;
+            snprintf(err_msg, NAME_MAX, "Could not map restore file \"%s\"!", restore_path);
+            perror(err_msg);
+            goto exit;
+        }
+        header = (const struct msr_save_header *)map;
+        cpu_size = msr_save_cpu_size(header->num_cpu);
+    }
+    if (!header ||
+        header->magic != MSR_SAVE_MAGIC ||
+        header->version != MSR_SAVE_VERSION ||
+        header->num_cpu == 0 ||
+        header->num_run > (uint64_t)header->num_cpu * header->num_msr ||
+        header->num_run > size / sizeof(*save_run) ||
+        size != sizeof(*header) + cpu_size + header->num_msr * sizeof(*save_msr) +
+                header->num_run * sizeof(*save_run))
+    {
+        err = -1;
+        fprintf(stderr, "Error: \"%s\" is not a version %d msrsave file!\n", restore_path, MSR_SAVE_VERSION);
         goto exit;
     }
-
-    /* Read contents */
-    num_read = read(tmp_fd, whitelist_buffer, whitelist_stat.st_size);
-    if (num_read != whitelist_stat.st_size)
+    save_cpu = (const uint32_t *)(header + 1);
+    save_msr = (const struct msr_save_msr *)((const char *)save_cpu + cpu_size);
+    save_run = (const struct msr_save_run *)(save_msr + header->num_msr);
+    if (header->checksum != msr_save_hash(0xCBF29CE484222325ULL, save_cpu, size - sizeof(*header)))
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Contents read from whitelist file is too small: %zu < %zu!", num_read, whitelist_stat.st_size);
-        perror(err_msg);
+        err = -1;
+        fprintf(stderr, "Error: checksum of \"%s\" does not match!\n", restore_path);
         goto exit;
     }
 
-    /* close file */
-    tmp_err = close(tmp_fd);
-    tmp_fd = -1;
-    if (tmp_err)
+    /* Map the index of each CPU and MSR in the file to its index in the
+       selection, or -1 if it is not selected */
+    cpu_map = (int *)malloc(header->num_cpu * sizeof(int));
+    msr_map = (long *)malloc((header->num_msr + 1) * sizeof(long));
+    if (!cpu_map || !msr_map)
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Unable to close temporary whitelist file called \"%s\"", tmp_path);
+        snprintf(err_msg, NAME_MAX, "Unable to allocate msr restore state buffer of size: %zu!",
+                 header->num_cpu * sizeof(int) + header->num_msr * sizeof(long));
         perror(err_msg);
         goto exit;
     }
-
-    /* Count the number of new lines in the file */
-    whitelist_ptr = whitelist_buffer;
-    for (num_msr = 0; (whitelist_ptr = strchr(whitelist_ptr, '\n')); ++num_msr)
+    for (i = 0; i < header->num_cpu; ++i)
     {
-        ++whitelist_ptr;
+        cpu_map[i] = msr_filter_cpu(filter, save_cpu[i]) ? num_cpu++ : -1;
     }
-    *num_msr_ptr = num_msr;
-
-    /* Allocate buffers for parsed whitelist */
-    msr_offset = *msr_offset_ptr = (uint64_t *)malloc(sizeof(uint64_t) * num_msr);
-    if (!msr_offset)
+    for (i = 0; i < header->num_msr; ++i)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Unable to allocate msr offset data of size: %zu!", sizeof(uint64_t) * num_msr);
-        perror(err_msg);
+        if (save_msr[i].scope > MSR_WHITELIST_PACKAGE)
+        {
+            err = -1;
+            fprintf(stderr, "Error: \"%s\" is not a version %d msrsave file!\n", restore_path, MSR_SAVE_VERSION);
+            goto exit;
+        }
+        msr_map[i] = msr_in_list(save_msr[i].offset, filter->num_msr, filter->msr) ? (long)num_msr++ : -1;
+    }
+    if (num_cpu == 0 || num_msr == 0)
+    {
+        err = -1;
+        fprintf(stderr, "Error: \"%s\" holds no selected MSR of a selected online CPU!\n", restore_path);
         goto exit;
     }
 
-    msr_mask = *msr_mask_ptr = (uint64_t *)malloc(sizeof(uint64_t) * num_msr);
-    if (!msr_mask)
+    *num_cpu_ptr = num_cpu;
+    *num_msr_ptr = num_msr;
+    *cpu_id_ptr = (int *)malloc(num_cpu * sizeof(int));
+    *msr_offset_ptr = (uint64_t *)malloc((num_msr + 1) * sizeof(uint64_t));
+    *msr_mask_ptr = (uint64_t *)malloc((num_msr + 1) * sizeof(uint64_t));
+    *msr_scope_ptr = (uint32_t *)malloc((num_msr + 1) * sizeof(uint32_t));
+    *restore_buffer_ptr = (uint64_t *)malloc((num_msr * num_cpu + 1) * sizeof(uint64_t));
+    if (!*cpu_id_ptr || !*msr_offset_ptr || !*msr_mask_ptr || !*msr_scope_ptr || !*restore_buffer_ptr)
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Unable to allocate msr mask data of size: %zu!", sizeof(uint64_t) * num_msr);
+        snprintf(err_msg, NAME_MAX, "Unable to allocate msr restore state buffer of size: %zu!",
+                 num_msr * num_cpu * sizeof(uint64_t));
         perror(err_msg);
         goto exit;
     }
+    for (i = 0; i < header->num_cpu; ++i)
+    {
+        if (cpu_map[i] != -1)
+        {
+            (*cpu_id_ptr)[cpu_map[i]] = save_cpu[i];
+        }
+    }
+    for (i = 0; i < header->num_msr; ++i)
+    {
+        if (msr_map[i] != -1)
+        {
+            (*msr_offset_ptr)[msr_map[i]] = save_msr[i].offset;
+            (*msr_mask_ptr)[msr_map[i]] = save_msr[i].mask;
+            (*msr_scope_ptr)[msr_map[i]] = save_msr[i].scope;
+        }
+    }
 
-    /* Parse the whitelist */
-    const char *whitelist_format = "MSR: %llx Write Mask: %llx\n";
-    whitelist_ptr = whitelist_buffer;
-    for (i = 0; i < num_msr; ++i)
+    /* Expand the runs of the selection, checking that they cover every MSR of every CPU */
+    for (run = save_run; !err && run < save_run + header->num_run; ++run)
     {
-        num_scan = sscanf(whitelist_ptr, whitelist_format, msr_offset + i, msr_mask + i);
-        if (num_scan != 2)
+        if (run->cpu_index == 0 && run->msr_index == next_msr && next_msr < header->num_msr)
         {
-            err = -1;
-            fprintf(stderr, "Error: Failed to parse whitelist file named \"%s\"\n", whitelist_path);
-            goto exit;
+            ++next_msr;
         }
-        whitelist_ptr = strchr(whitelist_ptr, '\n');
-        whitelist_ptr++; /* Move the pointer to the next line */
-        if (!whitelist_ptr)
+        else if (run->msr_index + 1 != next_msr || run->cpu_index <= cpu_index ||
+                 run->cpu_index >= header->num_cpu)
         {
             err = -1;
-            fprintf(stderr, "Error: Failed to parse whitelist file named \"%s\"\n", whitelist_path);
+            fprintf(stderr, "Error: \"%s\" is not a version %d msrsave file!\n", restore_path, MSR_SAVE_VERSION);
             goto exit;
         }
+        cpu_index = run->cpu_index;
+        for (i = cpu_index; msr_map[run->msr_index] != -1 && i < header->num_cpu &&
+             (run + 1 == save_run + header->num_run || run[1].msr_index != run->msr_index ||
+              i < run[1].cpu_index); ++i)
+        {
+            if (cpu_map[i] != -1)
+            {
+                (*restore_buffer_ptr)[cpu_map[i] * num_msr + msr_map[run->msr_index]] = run->value;
+            }
+        }
+    }
+    if (next_msr != header->num_msr)
+    {
+        err = -1;
+        fprintf(stderr, "Error: \"%s\" is not a version %d msrsave file!\n", restore_path, MSR_SAVE_VERSION);
+        goto exit;
     }
 
 exit:
-    unlink(tmp_path);
-    if (tmp_fd != -1)
+    if (cpu_map)
     {
-        close(tmp_fd);
+        free(cpu_map);
     }
-    if (whitelist_fd != -1)
+    if (msr_map)
     {
-        close(whitelist_fd);
+        free(msr_map);
     }
-    if (whitelist_buffer)
+    if (map != MAP_FAILED)
     {
-        free(whitelist_buffer);
+        munmap(map, size);
+    }
+    if (restore_fd != -1)
+    {
+        close(restore_fd);
     }
     return err;
 }
 
-int msr_save(const char *save_path, const char *whitelist_path, const char *msr_path_format, int num_cpu)
+int msr_save(const char *save_path, const char *whitelist_path, const char *msr_path_format,
+             const char *msr_batch_path, const char *cpu_sysfs_path, const char *cpu_list, const char *msr_list)
 {
     int err = 0;
-    int tmp_err = 0;
-    int i, j;
-    int msr_fd;
+    int batch_fd = -1;
+    int num_cpu = 0;
+    int i;
+    size_t j;
+    size_t k;
+    uint64_t cpu;
     char err_msg[NAME_MAX];
+    struct msr_filter filter;
     size_t num_msr = 0;
+    int *cpu_id = NULL;
+    int *scope_rep = NULL;
     uint64_t *msr_offset = NULL;
     uint64_t *msr_mask = NULL;
+    uint32_t *msr_scope = NULL;
     uint64_t *save_buffer = NULL;
-    FILE *save_fid = NULL;
+    char *do_read = NULL;
 
-    err = msr_parse_whitelist(whitelist_path, &num_msr, &msr_offset, &msr_mask);
+    err = msr_open_filter(cpu_sysfs_path, cpu_list, msr_list, &filter);
+    if (!err)
+    {
+        err = msr_parse_whitelist(whitelist_path, &num_msr, &msr_offset, &msr_mask, &msr_scope);
+    }
     if (err)
     {
         goto exit;
     }
 
-    /* Allocate save buffer, a 2-D array over msr offset and then CPU
-       (offset major ordering) */
-    save_buffer = (uint64_t *)malloc(num_msr * num_cpu * sizeof(uint64_t));
-    if (!save_buffer)
+    /* Only selected MSRs with writable bits are saved */
+    for (j = 0, k = 0; j < num_msr; ++j)
+    {
+        if (msr_mask[j] && msr_in_list(msr_offset[j], filter.num_msr, filter.msr))
+        {
+            msr_offset[k] = msr_offset[j];
+            msr_mask[k] = msr_mask[j];
+            msr_scope[k] = msr_scope[j];
+            ++k;
+        }
+    }
+    num_msr = k;
+
+    /* Only selected online CPUs are saved */
+    for (j = 0; j < filter.num_online; ++j)
+    {
+        for (cpu = filter.online[2 * j]; cpu <= filter.online[2 * j + 1]; ++cpu)
+        {
+            num_cpu += msr_in_list(cpu, filter.num_cpu, filter.cpu) ? 1 : 0;
+        }
+    }
+    if (num_cpu == 0 || num_msr == 0)
+    {
+        err = -1;
+        fprintf(stderr, "Error: No writable MSR of whitelist \"%s\" on an online CPU is selected!\n", whitelist_path);
+        goto exit;
+    }
+
+    /* Allocate save buffer, a 2-D array over CPU and then msr offset */
+    cpu_id = (int *)malloc(num_cpu * sizeof(int));
+    scope_rep = (int *)malloc((MSR_WHITELIST_PACKAGE + 1) * num_cpu * sizeof(int));
+    save_buffer = (uint64_t *)malloc(num_msr * num_cpu * sizeof(uint64_t) + 1);
+    do_read = (char *)malloc(num_msr * num_cpu + 1);
+    if (!cpu_id || !scope_rep || !save_buffer || !do_read)
     {
         err = errno ? errno : -1;
         snprintf(err_msg, NAME_MAX, "Unable to allocate msr save state buffer of size: %zu!", num_msr * num_cpu * sizeof(uint64_t));
         perror(err_msg);
         goto exit;
     }
-
-    /* Open all MSR files.
-     * Read ALL existing data
-     * Pass through the whitelist mask. */
-    for (i = 0; i < num_cpu; ++i)
+    for (j = 0, i = 0; j < filter.num_online; ++j)
     {
-        char msr_file_name[NAME_MAX];
-        snprintf(msr_file_name, NAME_MAX, msr_path_format, i);
-        msr_fd = open(msr_file_name, O_RDWR);
-        if (msr_fd == -1)
-        {
-            err = errno ? errno : -1;
-            snprintf(err_msg, NAME_MAX, "Could not open MSR file \"%s\"!", msr_file_name);
-            perror(err_msg);
-            goto exit;
-        }
-        for (j = 0; j < num_msr; ++j)
+        for (cpu = filter.online[2 * j]; cpu <= filter.online[2 * j + 1]; ++cpu)
         {
-            ssize_t read_count = pread(msr_fd, save_buffer + i * num_msr + j,
-                                       sizeof(uint64_t), msr_offset[j]);
-            if (read_count != sizeof(uint64_t))
+            if (msr_in_list(cpu, filter.num_cpu, filter.cpu))
             {
-                err = errno ? errno : -1;
-                snprintf(err_msg, NAME_MAX, "Failed to read msr value from MSR file \"%s\"!", msr_file_name);
-                perror(err_msg);
-                goto exit;
+                cpu_id[i++] = cpu;
             }
-            save_buffer[i * num_msr + j] &= msr_mask[j];
-        }
-        tmp_err = close(msr_fd);
-        msr_fd = -1;
-        if (tmp_err)
-        {
-            err = errno ? errno : -1;
-            snprintf(err_msg, NAME_MAX, "Could not close MSR file \"%s\"!", msr_file_name);
-            perror(err_msg);
-            goto exit;
         }
     }
-
-    /* Open output file. */
-    save_fid = fopen(save_path, "w");
-    if (!save_fid)
+    err = msr_scope_domains(cpu_sysfs_path, cpu_id, num_cpu, num_msr, msr_scope, scope_rep);
+    if (err)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not open output file \"%s\"!", save_path);
-        perror(err_msg);
         goto exit;
     }
+    msr_scope_access(num_cpu, num_msr, msr_scope, scope_rep, do_read);
 
-    size_t num_write = fwrite(save_buffer, sizeof(uint64_t), num_msr * num_cpu, save_fid);
-    if (num_write != num_msr * num_cpu)
+    /* Read ALL existing data once per scope domain
+     * Pass through the whitelist mask. */
+    batch_fd = msr_batch_open(msr_batch_path);
+    err = msr_read_all(batch_fd, msr_batch_path, msr_path_format, cpu_id, num_cpu, num_msr, msr_offset,
+                       save_buffer, do_read);
+    if (err)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not write all values to output file \"%s\"!", save_path);
-        perror(err_msg);
         goto exit;
     }
-
-    tmp_err = fclose(save_fid);
-    save_fid = NULL;
-    if (tmp_err)
+    msr_scope_fill(num_cpu, num_msr, msr_scope, scope_rep, save_buffer);
+    for (j = 0; j < num_msr * num_cpu; ++j)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not close MSR file \"%s\"!", save_path);
-        perror(err_msg);
-        goto exit;
+        save_buffer[j] &= msr_mask[j % num_msr];
     }
 
+    err = msr_write_snapshot(save_path, cpu_id, num_cpu, num_msr, msr_offset, msr_mask, msr_scope, save_buffer);
 
     /* Clean up memory and files */
 exit:
+    msr_close_filter(&filter);
     if (save_buffer)
     {
         free(save_buffer);
     }
+    if (do_read)
+    {
+        free(do_read);
+    }
+    if (cpu_id)
+    {
+        free(cpu_id);
+    }
+    if (scope_rep)
+    {
+        free(scope_rep);
+    }
     if (msr_offset)
     {
         free(msr_offset);
@@ -364,172 +1543,121 @@ exit:
     {
         free(msr_mask);
     }
-    if (save_fid)
+    if (msr_scope)
     {
-        fclose(save_fid);
+        free(msr_scope);
     }
-    if (msr_fd != -1)
+    if (batch_fd != -1)
     {
-        close(msr_fd);
+        close(batch_fd);
     }
     return err;
 }
 
-int msr_restore(const char *restore_path, const char *whitelist_path, const char *msr_path_format, int num_cpu)
+int msr_restore(const char *restore_path, const char *msr_path_format, const char *msr_batch_path,
+                const char *cpu_sysfs_path, const char *cpu_list, const char *msr_list)
 {
     int err = 0;
-    int tmp_err = 0;
-    int i, j;
-    int msr_fd;
+    int batch_fd = -1;
     int do_print_header = 1;
+    int num_cpu = 0;
     size_t num_msr = 0;
-    uint64_t read_val = 0;
-    uint64_t masked_val = 0;
-    uint64_t write_val = 0;
+    size_t j;
+    int *cpu_id = NULL;
+    int *scope_rep = NULL;
     uint64_t *msr_offset = NULL;
     uint64_t *msr_mask = NULL;
+    uint32_t *msr_scope = NULL;
     uint64_t *restore_buffer = NULL;
-    FILE *restore_fid = NULL;
-    struct stat restore_stat;
-    struct stat whitelist_stat;
+    uint64_t *read_buffer = NULL;
+    uint64_t *write_buffer = NULL;
+    char *do_read = NULL;
+    char *do_write = NULL;
     char err_msg[NAME_MAX];
+    struct msr_filter filter;
 
-    err = msr_parse_whitelist(whitelist_path, &num_msr, &msr_offset, &msr_mask);
-    if (err)
+    err = msr_open_filter(cpu_sysfs_path, cpu_list, msr_list, &filter);
+    if (!err)
     {
-        goto exit;
+        err = msr_read_snapshot(restore_path, &filter, &cpu_id, &num_cpu, &num_msr, &msr_offset, &msr_mask,
+                                &msr_scope, &restore_buffer);
     }
-
-    /* Check that the timestamp of the restore file is after the timestamp
-       for the whitelist file */
-    tmp_err = stat(restore_path, &restore_stat);
-    if (tmp_err != 0)
+    if (err)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "stat() of %s failed! ", restore_path);
-        perror(err_msg);
         goto exit;
     }
 
-    tmp_err = stat(whitelist_path, &whitelist_stat);
-    if (tmp_err != 0)
+    scope_rep = (int *)malloc((MSR_WHITELIST_PACKAGE + 1) * num_cpu * sizeof(int));
+    read_buffer = (uint64_t *)malloc(num_msr * num_cpu * sizeof(uint64_t) + 1);
+    write_buffer = (uint64_t *)malloc(num_msr * num_cpu * sizeof(uint64_t) + 1);
+    do_read = (char *)malloc(num_msr * num_cpu + 1);
+    do_write = (char *)malloc(num_msr * num_cpu + 1);
+    if (!scope_rep || !read_buffer || !write_buffer || !do_read || !do_write)
     {
         err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "stat() of %s failed! ", whitelist_path);
+        snprintf(err_msg, NAME_MAX, "Unable to allocate msr restore state buffer of size: %zu!", num_msr * num_cpu * sizeof(uint64_t));
         perror(err_msg);
         goto exit;
     }
 
-    if (restore_stat.st_mtime < whitelist_stat.st_mtime)
-    {
-        err = -1;
-        fprintf(stderr, "Error: whitelist was modified after restore file was written!");
-        goto exit;
-    }
-
-    /* Allocate restore buffer, a 2-D array over msr offset and then CPU
-       (offset major ordering) */
-    restore_buffer = (uint64_t *)malloc(num_msr * num_cpu * sizeof(uint64_t));
-    if (!restore_buffer)
+    err = msr_scope_domains(cpu_sysfs_path, cpu_id, num_cpu, num_msr, msr_scope, scope_rep);
+    if (err)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Unable to allocate msr restore state buffer of size: %zu!", num_msr * num_cpu * sizeof(uint64_t));
-        perror(err_msg);
         goto exit;
     }
+    msr_scope_access(num_cpu, num_msr, msr_scope, scope_rep, do_read);
 
-    restore_fid = fopen(restore_path, "r");
-    if (!restore_fid)
+    /* Read ALL existing data once per scope domain
+     * Pass through the whitelist mask
+     * Or in restore values
+     * Write back the values that changed. */
+    batch_fd = msr_batch_open(msr_batch_path);
+    err = msr_read_all(batch_fd, msr_batch_path, msr_path_format, cpu_id, num_cpu, num_msr, msr_offset,
+                       read_buffer, do_read);
+    if (err)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not open restore file \"%s\"!", restore_path);
-        perror(err_msg);
         goto exit;
     }
-
-    size_t num_read = fread(restore_buffer, sizeof(uint64_t), num_msr * num_cpu, restore_fid);
-    if (num_read != num_msr * num_cpu || fgetc(restore_fid) != EOF)
+    msr_scope_fill(num_cpu, num_msr, msr_scope, scope_rep, read_buffer);
+    for (j = 0; j < num_msr * num_cpu; ++j)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not read all values from input file \"%s\"!", restore_path);
-        perror(err_msg);
-        goto exit;
+        write_buffer[j] = (read_buffer[j] & ~(msr_mask[j % num_msr])) | (restore_buffer[j] & msr_mask[j % num_msr]);
+        do_write[j] = do_read[j] && write_buffer[j] != read_buffer[j];
     }
-
-    tmp_err = fclose(restore_fid);
-    restore_fid = NULL;
-    if (tmp_err)
+    err = msr_write_all(batch_fd, msr_batch_path, msr_path_format, cpu_id, num_cpu, num_msr, msr_offset,
+                        write_buffer, do_write);
+    if (err)
     {
-        err = errno ? errno : -1;
-        snprintf(err_msg, NAME_MAX, "Could not close MSR file \"%s\"!", restore_path);
-        perror(err_msg);
         goto exit;
     }
-
-    /* Open all MSR files.
-     * Read ALL existing data
-     * Pass through the whitelist mask
-     * Or in restore values
-     * Write back to MSR files. */
-    for (i = 0; i < num_cpu; ++i)
+    for (j = 0; j < num_msr * num_cpu; ++j)
     {
-        char msr_file_name[NAME_MAX];
-        snprintf(msr_file_name, NAME_MAX, msr_path_format, i);
-        msr_fd = open(msr_file_name, O_RDWR);
-        if (msr_fd == -1)
+        if (do_write[j])
         {
-            err = errno ? errno : -1;
-            snprintf(err_msg, NAME_MAX, "Could not open MSR file \"%s\"!", msr_file_name);
-            perror(err_msg);
-            goto exit;
-        }
-        for (j = 0; j < num_msr; ++j)
-        {
-            ssize_t count = pread(msr_fd, &read_val, sizeof(uint64_t), msr_offset[j]);
-            if (count != sizeof(uint64_t))
+            if (do_print_header)
             {
-                err = errno ? errno : -1;
-                snprintf(err_msg, NAME_MAX, "Failed to read msr value from MSR file \"%s\"!", msr_file_name);
-                perror(err_msg);
-                goto exit;
-            }
-            masked_val = (read_val & msr_mask[j]);
-            if (masked_val != restore_buffer[i * num_msr + j]) {
-                write_val = ((read_val & ~(msr_mask[j])) | restore_buffer[i * num_msr + j]);
-                count = pwrite(msr_fd, &write_val, sizeof(uint64_t), msr_offset[j]);
-                if (count != sizeof(uint64_t)) {
-                    err = errno ? errno : -1;
-                    snprintf(err_msg, NAME_MAX, "Failed to write msr value at offset 0x%016xz to MSR file \"%s\"!", msr_offset[j], msr_file_name);
-                    perror(err_msg);
-                    goto exit;
-                }
-                if (do_print_header) {
-                    printf("offset, read, restored\n");
-                    do_print_header = 0;
-                }
-                printf("0x%016zx, 0x%016zx, 0x%016zx\n", msr_offset[j], read_val, write_val);
+                printf("offset, read, restored\n");
+                do_print_header = 0;
             }
-        }
-        tmp_err = close(msr_fd);
-        msr_fd = -1;
-        if (tmp_err)
-        {
-            err = errno ? errno : -1;
-            snprintf(err_msg, NAME_MAX, "Could not close MSR file \"%s\"!", msr_file_name);
-            perror(err_msg);
-            goto exit;
+            printf("0x%016llx, 0x%016llx, 0x%016llx\n", (unsigned long long)msr_offset[j % num_msr],
+                   (unsigned long long)read_buffer[j], (unsigned long long)write_buffer[j]);
         }
     }
 
     /* Clean up memory and files */
 exit:
+    msr_close_filter(&filter);
     if (restore_buffer)
     {
         free(restore_buffer);
     }
-    if (restore_fid)
+    if (cpu_id)
+    {
+        free(cpu_id);
+    }
+    if (scope_rep)
     {
-        fclose(restore_fid);
+        free(scope_rep);
     }
     if (msr_offset)
     {
@@ -539,9 +1667,29 @@ exit:
     {
         free(msr_mask);
     }
-    if (msr_fd != -1)
+    if (msr_scope)
     {
-        close(msr_fd);
+        free(msr_scope);
+    }
+    if (read_buffer)
+    {
+        free(read_buffer);
+    }
+    if (write_buffer)
+    {
+        free(write_buffer);
+    }
+    if (do_read)
+    {
+        free(do_read);
+    }
+    if (do_write)
+    {
+        free(do_write);
+    }
+    if (batch_fd != -1)
+    {
+        close(batch_fd);
     }
     return err;
 }
@@ -33,14 +33,26 @@
 #ifndef MSRSAVE_H_INCLUDE
 #define MSRSAVE_H_INCLUDE
 
+/* If msr_batch_path is NULL or cannot be opened, each CPU's msr_path is
+   read and written instead.  A restore takes the CPUs, MSRs and write
+   masks from the save file rather than from the whitelist.  Only the CPUs
+   listed as online under cpu_sysfs_path, e.g. "/sys/devices/system/cpu",
+   and in cpu_list, e.g. "0-27,56-83", and the MSRs in msr_list, are saved
+   or restored; a NULL list selects all.  An MSR of core, module or package
+   scope is accessed once per domain in the topology under cpu_sysfs_path. */
 int msr_save(const char *out_path,
              const char *whitelist_path,
              const char *msr_path,
-             int num_cpu);
+             const char *msr_batch_path,
+             const char *cpu_sysfs_path,
+             const char *cpu_list,
+             const char *msr_list);
 
 int msr_restore(const char *in_path,
-                const char *whitelist_path,
                 const char *msr_path,
-                int num_cpu);
+                const char *msr_batch_path,
+                const char *cpu_sysfs_path,
+                const char *cpu_list,
+                const char *msr_list);
 
 #endif
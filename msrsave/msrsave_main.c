@@ -53,10 +53,10 @@ int main(int argc, char **argv)
 "\n"
 "SYNOPSIS\n"
 "       SAVE MSR:\n"
-"              msrsave outfile\n"
+"              msrsave [--cpus=list] [--msr=list] outfile\n"
 "\n"
 "       RESTORE MSR:\n"
-"              msrsave -r infile\n"
+"              msrsave -r [--cpus=list] [--msr=list] infile\n"
 "\n"
 "       PRINT VERSION OR HELP:\n"
 "              msrsave --version | --help\n"
@@ -79,6 +79,14 @@ int main(int argc, char **argv)
 "              Restore the MSR values that are recorded in an existing MSR saved state\n"
 "              file.\n"
 "\n"
+"       --cpus=list\n"
+"              Save or restore only the CPUs in list, e.g. 0-27,56-83.  By default all\n"
+"              online CPUs are used, and offline CPUs are always skipped.\n"
+"\n"
+"       --msr=list\n"
+"              Save or restore only the MSRs in list, e.g. 0x610,0x774 or\n"
+"              0x600-0x6ff.\n"
+"\n"
 "COPYRIGHT\n"
 "       Copyright (C) 2016, Intel Corporation. All rights reserved.\n"
 "\n"
@@ -102,14 +110,27 @@ int main(int argc, char **argv)
     int err = 0;
     int do_restore = 0;
     int opt = 0;
+    const char *cpu_list = NULL;
+    const char *msr_list = NULL;
+    const struct option long_options[] = {
+        {"cpus", required_argument, NULL, 'c'},
+        {"msr", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0}
+    };
 
-    while (!err && (opt = getopt(argc, argv, "r")) != -1)
+    while (!err && (opt = getopt_long(argc, argv, "r", long_options, NULL)) != -1)
     {
         switch (opt)
         {
             case 'r':
                 do_restore = 1;
                 break;
+            case 'c':
+                cpu_list = optarg;
+                break;
+            case 'm':
+                msr_list = optarg;
+                break;
             default:
                 fprintf(stderr, "Error: Unknown parameter \"%c\"\n\n", opt);
                 fprintf(stderr, usage, argv[0]);
@@ -130,14 +151,16 @@ int main(int argc, char **argv)
         const char *file_name = argv[optind];
         const char *msr_path = "/dev/cpu/%d/msr_safe";
         const char *msr_whitelist_path = "/dev/cpu/msr_whitelist";
-        int num_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        const char *msr_batch_path = "/dev/cpu/msr_batch";
+        const char *cpu_sysfs_path = "/sys/devices/system/cpu";
         if (do_restore)
         {
-            err = msr_restore(file_name, msr_whitelist_path, msr_path, num_cpu);
+            err = msr_restore(file_name, msr_path, msr_batch_path, cpu_sysfs_path, cpu_list, msr_list);
         }
         else
         {
-            err = msr_save(file_name, msr_whitelist_path, msr_path, num_cpu);
+            err = msr_save(file_name, msr_whitelist_path, msr_path, msr_batch_path, cpu_sysfs_path,
+                           cpu_list, msr_list);
         }
     }
 
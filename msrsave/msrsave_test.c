@@ -31,17 +31,34 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "../msr.h"
 #include "msrsave.h"
 
+/* Stub of the batch device, with MSRs as read and written by batch ops */
+enum {STUB_NUM_CPU = 10, STUB_NUM_MSR = 1024};
+static uint64_t stub_msr[STUB_NUM_CPU][STUB_NUM_MSR];
+static int stub_num_call = 0;
+static uint32_t stub_max_ops = 0;
+static int stub_errno = 0;
+static int stub_dump = 0;
+/* Dumped whitelist: 0x0 and 0x10 share a package scope run, 0x20 is per thread */
+static const struct msr_whitelist_record stub_record[] = {{0x0, 0, ~0ULL}, {0x10, 0, ~0ULL}, {0x20, 0, ~0ULL}};
+static const struct msr_whitelist_attr stub_attr[] = {{0x0, 0x10, 0, 0, MSR_WHITELIST_PACKAGE, {0, 0}, 0, 0}};
+
+int ioctl(int fd, unsigned long request, ...);
 void msrsave_test_mock_msr(void *buffer, size_t buffer_size, const char *path_format, int num_cpu);
 void msrsave_test_check_msr(uint64_t *buffer, size_t num_check, const char *path_format, int num_cpu);
+void msrsave_test_mkdir(const char *path);
 
 void msrsave_test_mock_msr(void *buffer, size_t buffer_size, const char *path_format, int num_cpu)
 {
@@ -81,6 +98,71 @@ void msrsave_test_check_msr(uint64_t *check_val, size_t num_check, const char *p
 }
 
 
+void msrsave_test_mkdir(const char *path)
+{
+    /* Create a mock sysfs directory, which an aborted run may have left */
+    int err = mkdir(path, 0755) ? errno : 0;
+    assert(err == 0 || err == EEXIST);
+    (void)err;
+}
+
+/* Run X86_IOC_MSR_BATCH against stub_msr, or fail with stub_errno if set.
+   X86_IOC_MSR_WHITELIST_DUMP returns stub_record and stub_attr if
+   stub_dump is set.  Nothing else is supported. */
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    struct msr_batch_array *batch;
+    struct msr_whitelist_dump *dump;
+    uint32_t i;
+
+    if (request == X86_IOC_MSR_WHITELIST_DUMP && stub_dump)
+    {
+        va_start(args, request);
+        dump = va_arg(args, struct msr_whitelist_dump *);
+        va_end(args);
+        i = dump->nrecords < 3 || dump->nattrs < 1;
+        if (!i)
+        {
+            memcpy(dump->records, stub_record, sizeof(stub_record));
+            memcpy(dump->attrs, stub_attr, sizeof(stub_attr));
+        }
+        dump->nrecords = 3;
+        dump->nattrs = 1;
+        errno = i ? ENOSPC : 0;
+        return i ? -1 : 0;
+    }
+    if (request != X86_IOC_MSR_BATCH)
+    {
+        errno = ENOTTY;
+        return -1;
+    }
+    ++stub_num_call;
+    if (stub_errno)
+    {
+        errno = stub_errno;
+        return -1;
+    }
+    va_start(args, request);
+    batch = va_arg(args, struct msr_batch_array *);
+    va_end(args);
+    stub_max_ops = batch->numops > stub_max_ops ? batch->numops : stub_max_ops;
+    for (i = 0; i < batch->numops; ++i)
+    {
+        struct msr_batch_op *op = batch->ops + i;
+        assert(op->cpu < STUB_NUM_CPU && op->msr < STUB_NUM_MSR);
+        if (op->isrdmsr)
+        {
+            op->msrdata = stub_msr[op->cpu][op->msr];
+        }
+        else
+        {
+            stub_msr[op->cpu][op->msr] = op->msrdata;
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int err = 0;
@@ -131,19 +213,33 @@ int main(int argc, char **argv)
     const char *test_save_path = "msrsave_test_store";
     const char *test_whitelist_path = "msrsave_test_whitelist";
     const char *test_msr_path = "msrsave_test_msr.%d";
+    const char *test_batch_path = "msrsave_test_batch"; /* Absent, so the msr files are used */
+    const char *test_sysfs_path = "msrsave_test_cpu";
+    const char *test_online_path = "msrsave_test_cpu/online";
+    const char *test_topology_path = "msrsave_test_cpu/cpu%d";
+    const char *test_package_path = "msrsave_test_cpu/cpu%d/topology";
+    const char *test_siblings_path = "msrsave_test_cpu/cpu%d/topology/core_siblings_list";
     const char *whitelist_format = "MSR: %.8llx Write Mask: %.16llx\n";
     const int num_cpu = 10;
     int i;
 
-    /* Create a mock white list from the data in the constants above. */
+    /* Create a mock white list from the data in the constants above,
+       listed in descending order as msrsave must not rely on the order. */
     FILE *fid = fopen(test_whitelist_path, "w");
     assert(fid != NULL);
-    for (i = 0; i < NUM_MSR; ++i)
+    for (i = NUM_MSR - 1; i >= 0; --i)
     {
         fprintf(fid, whitelist_format, whitelist_off[i], whitelist_mask[i]);
     }
     fclose(fid);
 
+    /* Create a mock list of online CPUs */
+    msrsave_test_mkdir(test_sysfs_path);
+    fid = fopen(test_online_path, "w");
+    assert(fid != NULL);
+    fprintf(fid, "0-%d\n", num_cpu - 1);
+    fclose(fid);
+
     uint64_t lval = 0x0;
     uint64_t hval = 0xDEADBEEF;
     uint64_t msr_val[NUM_MSR];
@@ -158,7 +254,8 @@ int main(int argc, char **argv)
     msrsave_test_mock_msr(msr_val, sizeof(msr_val), test_msr_path, num_cpu);
 
     /* Save the current state to a file */
-    err = msr_save(test_save_path, test_whitelist_path, test_msr_path, num_cpu);
+    err = msr_save(test_save_path, test_whitelist_path, test_msr_path, test_batch_path, test_sysfs_path,
+                   NULL, NULL);
     assert(err == 0);
 
     /* Overwrite the mock msr files with new data */
@@ -172,7 +269,7 @@ int main(int argc, char **argv)
     msrsave_test_mock_msr(msr_val, sizeof(msr_val), test_msr_path, num_cpu);
 
     /* Restore to the original values */
-    err = msr_restore(test_save_path, test_whitelist_path, test_msr_path, num_cpu);
+    err = msr_restore(test_save_path, test_msr_path, test_batch_path, test_sysfs_path, NULL, NULL);
     assert(err == 0);
 
     /* Check that the values that are writable have been restored. */
@@ -185,13 +282,198 @@ int main(int argc, char **argv)
     }
     msrsave_test_check_msr(msr_val, sizeof(msr_val) / sizeof(uint64_t), test_msr_path, num_cpu);
 
+    /* Check that a restore limited to some CPUs and MSRs writes only those
+       of them that are online, here CPUs 2 and 6 and MSRs 0x8, 0x18 and 0x20. */
+    hval = 0x1EADBEEF;
+    for (i = 0; i < NUM_MSR; ++i)
+    {
+        lval = NUM_MSR - i;
+        msr_val[i] = lval | (hval << 32);
+    }
+    msrsave_test_mock_msr(msr_val, sizeof(msr_val), test_msr_path, num_cpu);
+    fid = fopen(test_online_path, "w");
+    assert(fid != NULL);
+    fprintf(fid, "0-4,6-%d\n", num_cpu - 1);
+    fclose(fid);
+    err = msr_restore(test_save_path, test_msr_path, test_batch_path, test_sysfs_path, "2,5-6", "0x8,0x18-0x20");
+    assert(err == 0);
+    for (i = 0; i < num_cpu; ++i)
+    {
+        char this_path[NAME_MAX] = {};
+        uint64_t read_val[NUM_MSR];
+        int j;
+        snprintf(this_path, NAME_MAX, test_msr_path, i);
+        fid = fopen(this_path, "r");
+        assert(fid != NULL);
+        assert(fread(read_val, sizeof(uint64_t), NUM_MSR, fid) == NUM_MSR);
+        fclose(fid);
+        for (j = 0; j < NUM_MSR; ++j)
+        {
+            int is_restored = (i == 2 || i == 6) &&
+                              (whitelist_off[j] == 0x8 || (whitelist_off[j] >= 0x18 && whitelist_off[j] <= 0x20));
+            assert(read_val[j] == (msr_val[j] | (is_restored ? 0x8000000000000000ULL : 0)));
+        }
+    }
+
+    /* Check that a damaged save file is refused and nothing is written. */
+    fid = fopen(test_save_path, "r+");
+    assert(fid != NULL);
+    fseek(fid, -1, SEEK_END);
+    i = fgetc(fid);
+    fseek(fid, -1, SEEK_END);
+    fputc(i ^ 0x80, fid);
+    fclose(fid);
+    msrsave_test_mock_msr(msr_val, sizeof(msr_val), test_msr_path, num_cpu);
+    err = msr_restore(test_save_path, test_msr_path, test_batch_path, test_sysfs_path, NULL, NULL);
+    assert(err != 0);
+    msrsave_test_check_msr(msr_val, sizeof(msr_val) / sizeof(uint64_t), test_msr_path, num_cpu);
+    err = 0;
+
+    /* Check that an MSR of package scope is read and written once per
+       package, here through CPU 0 for CPUs 0-4 and CPU 5 for CPUs 5-9, and
+       that the save file holds the value read for each CPU of the package. */
     char this_path[NAME_MAX] = {};
+    fid = fopen(test_whitelist_path, "w");
+    assert(fid != NULL);
+    fprintf(fid, "MSR: 00000000 Write Mask: ffffffffffffffff Scope: package\n");
+    fclose(fid);
+    fid = fopen(test_online_path, "w");
+    assert(fid != NULL);
+    fprintf(fid, "0-%d\n", num_cpu - 1);
+    fclose(fid);
+    for (i = 0; i < num_cpu; ++i)
+    {
+        snprintf(this_path, NAME_MAX, test_topology_path, i);
+        msrsave_test_mkdir(this_path);
+        snprintf(this_path, NAME_MAX, test_package_path, i);
+        msrsave_test_mkdir(this_path);
+        snprintf(this_path, NAME_MAX, test_siblings_path, i);
+        fid = fopen(this_path, "w");
+        assert(fid != NULL);
+        int package = i < num_cpu / 2 ? 0 : num_cpu / 2;
+        fprintf(fid, "%d-%d\n", package, package + num_cpu / 2 - 1);
+        fclose(fid);
+        lval = 0x100 + i;
+        snprintf(this_path, NAME_MAX, test_msr_path, i);
+        fid = fopen(this_path, "w");
+        assert(fid != NULL);
+        fwrite(&lval, sizeof(uint64_t), 1, fid);
+        fclose(fid);
+    }
+    err = msr_save(test_save_path, test_whitelist_path, test_msr_path, test_batch_path, test_sysfs_path,
+                   NULL, NULL);
+    assert(err == 0);
+    for (i = 0; i < num_cpu; ++i)
+    {
+        lval = 0x200 + i;
+        snprintf(this_path, NAME_MAX, test_msr_path, i);
+        fid = fopen(this_path, "w");
+        assert(fid != NULL);
+        fwrite(&lval, sizeof(uint64_t), 1, fid);
+        fclose(fid);
+    }
+    err = msr_restore(test_save_path, test_msr_path, test_batch_path, test_sysfs_path, NULL, NULL);
+    assert(err == 0);
+    err = msr_restore(test_save_path, test_msr_path, test_batch_path, test_sysfs_path, "3", NULL);
+    assert(err == 0);
     for (i = 0; i < num_cpu; ++i)
     {
         snprintf(this_path, NAME_MAX, test_msr_path, i);
+        fid = fopen(this_path, "r");
+        assert(fid != NULL);
+        assert(fread(&lval, sizeof(uint64_t), 1, fid) == 1);
+        fclose(fid);
+        if (i == 0 || i == num_cpu / 2)
+        {
+            assert(lval == 0x100 + i);
+        }
+        else if (i == 3)
+        {
+            assert(lval == 0x100);
+        }
+        else
+        {
+            assert(lval == 0x200 + i);
+        }
+    }
+
+    /* Check that through the batch device the 10240 reads of a save and of
+       a restore are split across requests, here two each, with the writes
+       of the restore in a third, and that a restore falls back to the msr
+       files when the kernel cannot allocate a request. */
+    assert(num_cpu == STUB_NUM_CPU);
+    fid = fopen(test_batch_path, "w");
+    assert(fid != NULL);
+    fclose(fid);
+    fid = fopen(test_whitelist_path, "w");
+    assert(fid != NULL);
+    fprintf(fid, "MSR: 00000000-%.8x Write Mask: ffffffffffffffff\n", STUB_NUM_MSR - 1);
+    fclose(fid);
+    for (i = 0; i < num_cpu * STUB_NUM_MSR; ++i)
+    {
+        stub_msr[i / STUB_NUM_MSR][i % STUB_NUM_MSR] = 0x300000 + i;
+    }
+    err = msr_save(test_save_path, test_whitelist_path, test_msr_path, test_batch_path, test_sysfs_path,
+                   NULL, NULL);
+    assert(err == 0);
+    assert(stub_num_call == 2 && stub_max_ops < (uint32_t)num_cpu * STUB_NUM_MSR);
+    for (i = 0; i < num_cpu; ++i)
+    {
+        stub_msr[i][STUB_NUM_MSR - 1] = 0;
+    }
+    stub_num_call = 0;
+    err = msr_restore(test_save_path, test_msr_path, test_batch_path, test_sysfs_path, NULL, NULL);
+    assert(err == 0);
+    assert(stub_num_call == 3 && stub_max_ops < (uint32_t)num_cpu * STUB_NUM_MSR);
+    for (i = 0; i < num_cpu * STUB_NUM_MSR; ++i)
+    {
+        assert(stub_msr[i / STUB_NUM_MSR][i % STUB_NUM_MSR] == 0x300000 + (uint64_t)i);
+    }
+    memset(msr_val, 0, sizeof(msr_val));
+    msrsave_test_mock_msr(msr_val, sizeof(msr_val), test_msr_path, num_cpu);
+    stub_errno = ENOMEM;
+    err = msr_restore(test_save_path, test_msr_path, test_batch_path, test_sysfs_path, NULL, "0x0,0x10");
+    assert(err == 0);
+    stub_errno = 0;
+    for (i = 0; i < num_cpu; ++i)
+    {
+        uint64_t read_val[3];
+        snprintf(this_path, NAME_MAX, test_msr_path, i);
+        fid = fopen(this_path, "r");
+        assert(fid != NULL);
+        assert(fread(read_val, sizeof(uint64_t), 3, fid) == 3);
+        fclose(fid);
+        assert(read_val[0] == 0x300000 + (uint64_t)i * STUB_NUM_MSR);
+        assert(read_val[1] == 0);
+        assert(read_val[2] == 0x300000 + (uint64_t)i * STUB_NUM_MSR + 0x10);
+    }
+
+    /* Check that a dumped whitelist gives each record the scope of the
+       attribute run covering it: 0x0 and 0x10 are read once per package
+       and 0x20 once per CPU. */
+    stub_dump = 1;
+    stub_max_ops = 0;
+    err = msr_save(test_save_path, test_whitelist_path, test_msr_path, test_batch_path, test_sysfs_path,
+                   NULL, NULL);
+    assert(err == 0);
+    assert(stub_max_ops == 2 * 2 + (uint32_t)num_cpu);
+    stub_dump = 0;
+
+    for (i = 0; i < num_cpu; ++i)
+    {
+        snprintf(this_path, NAME_MAX, test_msr_path, i);
+        unlink(this_path);
+        snprintf(this_path, NAME_MAX, test_siblings_path, i);
         unlink(this_path);
+        snprintf(this_path, NAME_MAX, test_package_path, i);
+        rmdir(this_path);
+        snprintf(this_path, NAME_MAX, test_topology_path, i);
+        rmdir(this_path);
     }
     unlink(test_whitelist_path);
+    unlink(test_batch_path);
+    unlink(test_online_path);
+    rmdir(test_sysfs_path);
     unlink(test_save_path);
     return err;
 }
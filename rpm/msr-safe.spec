@@ -24,6 +24,7 @@ Allows safer access to model specific registers (MSRs)
 %autosetup -n %{name}-%{rev}
 
 %build
+%{__make} msr_whitelist_builtin.c
 for flavor in %flavors_to_build; do
     rm -rf obj/$flavor
     mkdir -p obj/$flavor
@@ -0,0 +1,683 @@
+/*
+#  Copyright (c) 2011, 2012, 2013, 2014, 2015 by Lawrence Livermore National Security, LLC. LLNL-CODE-645430
+#  Produced at the Lawrence Livermore National Laboratory.
+#  Written by Marty McFadden, Kathleen Shoga and Barry Rountree (mcfadden1|shoga1|rountree@llnl.gov).
+#  All rights reserved.
+#
+#  This file is part of msr-safe.
+#
+#  msr-safe is free software: you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation, either
+#  version 3 of the License, or (at your option) any
+#  later version.
+#
+#  msr-safe is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along
+#  with msr-safe. If not, see <http://www.gnu.org/licenses/>.
+#
+#  This material is based upon work supported by the U.S. Department
+#  of Energy's Lawrence Livermore National Laboratory. Office of
+#  Science, under Award number DE-AC52-07NA27344.
+*/
+/*
+ * Convert text whitelists into the binary image format that
+ * /dev/cpu/msr_whitelist also accepts (see msr.h), or back.
+ *
+ * usage: msr_wlcompile whitelist image
+ *        msr_wlcompile -d image
+ *        msr_wlcompile -c source whitelist...
+ *
+ * The image may then be installed with:
+ *        cat image > /dev/cpu/msr_whitelist
+ *
+ * With -c, the whitelists are written out as C tables that the module
+ * builds in as per-model defaults (msr_whitelist_builtin.c).
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../msr.h"
+
+static int parse_number(const char *str, uint64_t *val)
+{
+    char *end = NULL;
+    errno = 0;
+    *val = strtoull(str, &end, 0);
+    return (errno || end == str || *end) ? -1 : 0;
+}
+
+static const char *scope_name[] = {"thread", "core", "module", "package"};
+
+/* A whitelist line: its record, and its attributes if has_attr() */
+struct wl_entry
+{
+    struct msr_whitelist_record rec;
+    struct msr_whitelist_attr attr;
+};
+
+static int has_attr(const struct msr_whitelist_attr *attr)
+{
+    return attr->width || attr->scope || attr->op || attr->scale;
+}
+
+static int same_attr(const struct msr_whitelist_attr *a, const struct msr_whitelist_attr *b)
+{
+    return a->width == b->width && a->scope == b->scope && a->op == b->op &&
+           a->in[0] == b->in[0] && a->in[1] == b->in[1] && a->scale == b->scale;
+}
+
+static int parse_attribute(char *attr, struct msr_whitelist_attr *rec)
+{
+    int err = 0;
+    uint64_t val = 0;
+    uint64_t val2 = 0;
+    char *value = strchr(attr, '=');
+    char *slash = NULL;
+
+    if (!value)
+    {
+        return -1;
+    }
+    *value++ = '\0';
+
+    if (strcmp(attr, "width") == 0)
+    {
+        err = parse_number(value, &val);
+        if (!err && (val == 0 || val >= 64))
+        {
+            err = -1;
+        }
+        rec->width = val;
+    }
+    else if (strcmp(attr, "scope") == 0)
+    {
+        for (rec->scope = MSR_WHITELIST_THREAD;
+             rec->scope <= MSR_WHITELIST_PACKAGE && strcmp(value, scope_name[rec->scope]) != 0;
+             ++rec->scope);
+        err = rec->scope > MSR_WHITELIST_PACKAGE ? -1 : 0;
+    }
+    else if (strcmp(attr, "scale") == 0)
+    {
+        err = parse_number(value, &val);
+        if (!err && val == 0)
+        {
+            err = -1;
+        }
+        rec->scale = val;
+    }
+    else if (rec->op)
+    {
+        err = -1; /* More than one derivation */
+    }
+    else if (strcmp(attr, "delta") == 0 || strcmp(attr, "rate") == 0)
+    {
+        rec->op = strcmp(attr, "delta") == 0 ? MSR_WHITELIST_DELTA : MSR_WHITELIST_RATE;
+        err = parse_number(value, &val);
+        rec->in[0] = val;
+    }
+    else if (strcmp(attr, "ratio") == 0)
+    {
+        rec->op = MSR_WHITELIST_RATIO;
+        slash = strchr(value, '/');
+        if (!slash)
+        {
+            return -1;
+        }
+        *slash++ = '\0';
+        err = parse_number(value, &val) || parse_number(slash, &val2);
+        rec->in[0] = val;
+        rec->in[1] = val2;
+    }
+    else
+    {
+        err = -1;
+    }
+    if (!err && (val > UINT32_MAX || val2 > UINT32_MAX))
+    {
+        err = -1;
+    }
+    return err;
+}
+
+/* Returns 1 if line held an entry, 0 if it held none, -1 on error. */
+static int parse_line(char *line, struct wl_entry *ent)
+{
+    char *save = NULL;
+    char *tok = NULL;
+    char *dash = NULL;
+    uint64_t msr = 0;
+    uint64_t last = 0;
+    uint64_t wmask = 0;
+    char *comment = strchr(line, '#');
+
+    if (comment)
+    {
+        *comment = '\0';
+    }
+    memset(ent, 0, sizeof(*ent));
+
+    tok = strtok_r(line, " \t\r\n", &save);
+    if (!tok)
+    {
+        return 0;
+    }
+    dash = strchr(tok, '-');
+    if (dash)
+    {
+        *dash++ = '\0';
+        if (parse_number(dash, &last) || last > UINT32_MAX)
+        {
+            return -1;
+        }
+    }
+    if (parse_number(tok, &msr) || msr > UINT32_MAX || (dash && last < msr))
+    {
+        return -1;
+    }
+    tok = strtok_r(NULL, " \t\r\n", &save);
+    if (!tok || parse_number(tok, &wmask))
+    {
+        return -1;
+    }
+    ent->rec.msr = msr;
+    ent->rec.last = last > msr ? last : 0;
+    ent->rec.wmask = wmask;
+    ent->attr.msr = msr;
+
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)))
+    {
+        if (parse_attribute(tok, &ent->attr))
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static int compare_entry(const void *a, const void *b)
+{
+    const struct wl_entry *ea = (const struct wl_entry *)a;
+    const struct wl_entry *eb = (const struct wl_entry *)b;
+    return ea->rec.msr < eb->rec.msr ? -1 : ea->rec.msr > eb->rec.msr;
+}
+
+/*
+ * Read a text whitelist into a newly allocated array of entries sorted by
+ * MSR, rejecting overlapping entries.
+ */
+static int load_entries(const char *in_path, struct wl_entry **ent_out, uint32_t *nrecords_out)
+{
+    int err = 0;
+    FILE *in = NULL;
+    char line[1024];
+    int line_num = 0;
+    int res;
+    uint32_t i;
+    uint32_t cap = 0;
+    uint32_t nrecords = 0;
+    struct wl_entry *ent = NULL;
+    struct wl_entry *tmp = NULL;
+
+    in = fopen(in_path, "r");
+    if (!in)
+    {
+        err = errno ? errno : -1;
+        perror(in_path);
+        goto exit;
+    }
+    while (fgets(line, sizeof(line), in))
+    {
+        ++line_num;
+        if (nrecords == cap)
+        {
+            cap = cap ? 2 * cap : 256;
+            tmp = (struct wl_entry *)realloc(ent, cap * sizeof(*ent));
+            if (!tmp)
+            {
+                err = errno ? errno : -1;
+                perror("Unable to allocate records");
+                goto exit;
+            }
+            ent = tmp;
+        }
+        res = parse_line(line, ent + nrecords);
+        if (res < 0)
+        {
+            err = -1;
+            fprintf(stderr, "Error: %s:%d: invalid entry\n", in_path, line_num);
+            goto exit;
+        }
+        nrecords += res;
+    }
+
+    qsort(ent, nrecords, sizeof(*ent), compare_entry);
+    for (i = 1; i < nrecords; ++i)
+    {
+        if (ent[i].rec.msr <= (ent[i - 1].rec.last ? ent[i - 1].rec.last : ent[i - 1].rec.msr))
+        {
+            err = -1;
+            fprintf(stderr, "Error: %s: duplicate entry for 0x%08X\n", in_path, ent[i].rec.msr);
+            goto exit;
+        }
+    }
+
+exit:
+    if (in)
+    {
+        fclose(in);
+    }
+    if (err && ent)
+    {
+        free(ent);
+        ent = NULL;
+    }
+    *ent_out = ent;
+    *nrecords_out = err ? 0 : nrecords;
+    return err;
+}
+
+/*
+ * Fill attr with the attributes of the entries, one for each run of
+ * consecutive entries that have the same ones, and return how many.  attr
+ * must have room for nrecords.
+ */
+static uint32_t merge_attrs(const struct wl_entry *ent, uint32_t nrecords, struct msr_whitelist_attr *attr)
+{
+    uint32_t nattrs = 0;
+    uint32_t i;
+
+    for (i = 0; i < nrecords; ++i)
+    {
+        if (!has_attr(&ent[i].attr))
+        {
+            continue;
+        }
+        if (i && has_attr(&ent[i - 1].attr) && same_attr(&ent[i].attr, &attr[nattrs - 1]))
+        {
+            attr[nattrs - 1].last = ent[i].rec.msr;
+        }
+        else
+        {
+            attr[nattrs++] = ent[i].attr;
+        }
+    }
+    return nattrs;
+}
+
+static int compile(const char *in_path, const char *out_path)
+{
+    int err = 0;
+    FILE *out = NULL;
+    struct msr_whitelist_header hdr = {MSR_WHITELIST_MAGIC, MSR_WHITELIST_VERSION, 0, 0};
+    struct wl_entry *ent = NULL;
+    struct msr_whitelist_attr *attr = NULL;
+    uint32_t i;
+
+    err = load_entries(in_path, &ent, &hdr.nrecords);
+    if (err)
+    {
+        goto exit;
+    }
+    attr = (struct msr_whitelist_attr *)malloc((hdr.nrecords + 1) * sizeof(*attr));
+    if (!attr)
+    {
+        err = errno ? errno : -1;
+        perror("Unable to allocate attributes");
+        goto exit;
+    }
+    hdr.nattrs = merge_attrs(ent, hdr.nrecords, attr);
+    out = fopen(out_path, "w");
+    if (!out)
+    {
+        err = errno ? errno : -1;
+        perror(out_path);
+        goto exit;
+    }
+    err = fwrite(&hdr, sizeof(hdr), 1, out) != 1;
+    for (i = 0; !err && i < hdr.nrecords; ++i)
+    {
+        err = fwrite(&ent[i].rec, sizeof(ent[i].rec), 1, out) != 1;
+    }
+    if (err || fwrite(attr, sizeof(*attr), hdr.nattrs, out) != hdr.nattrs)
+    {
+        err = errno ? errno : -1;
+        perror(out_path);
+        goto exit;
+    }
+
+exit:
+    if (out && fclose(out) && !err)
+    {
+        err = errno ? errno : -1;
+        perror(out_path);
+    }
+    if (attr)
+    {
+        free(attr);
+    }
+    if (ent)
+    {
+        free(ent);
+    }
+    return err;
+}
+
+/*
+ * Whitelists named wl_FFMM carry the CPU family and model they apply to in
+ * hex.  Anything else (tests, notes) is not built in.
+ */
+static int parse_model(const char *path, unsigned *family, unsigned *model)
+{
+    const char *name = strrchr(path, '/');
+    char tail;
+
+    name = name ? name + 1 : path;
+    if (strlen(name) != 7 ||
+        sscanf(name, "wl_%2x%2x%c", family, model, &tail) != 2)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write a C source defining msr_whitelist_builtins[] from the text
+ * whitelists given, for the module to install at load time (see
+ * msr_whitelist.h).
+ */
+static int builtin(const char *out_path, int npaths, char **paths)
+{
+    int err = 0;
+    FILE *out = NULL;
+    struct wl_entry *ent = NULL;
+    struct msr_whitelist_attr *attr = NULL;
+    struct msr_whitelist_attr *tmp_attr = NULL;
+    uint32_t nrecords = 0;
+    uint32_t *nattrs = NULL;
+    unsigned family;
+    unsigned model;
+    uint32_t i;
+    int p;
+
+    nattrs = (uint32_t *)calloc(npaths + 1, sizeof(*nattrs));
+    if (!nattrs)
+    {
+        err = errno ? errno : -1;
+        perror("Unable to allocate attributes");
+        goto exit;
+    }
+    out = fopen(out_path, "w");
+    if (!out)
+    {
+        err = errno ? errno : -1;
+        perror(out_path);
+        goto exit;
+    }
+    fprintf(out, "/* Generated by msr_wlcompile -c from whitelists/; do not edit. */\n"
+                 "#include <linux/kernel.h>\n"
+                 "\n"
+                 "#include \"msr.h\"\n"
+                 "#include \"msr_whitelist.h\"\n");
+    for (p = 0; p < npaths; ++p)
+    {
+        if (parse_model(paths[p], &family, &model))
+        {
+            continue;
+        }
+        err = load_entries(paths[p], &ent, &nrecords);
+        if (err)
+        {
+            goto exit;
+        }
+        tmp_attr = (struct msr_whitelist_attr *)realloc(attr, (nrecords + 1) * sizeof(*attr));
+        if (!tmp_attr)
+        {
+            err = errno ? errno : -1;
+            perror("Unable to allocate attributes");
+            goto exit;
+        }
+        attr = tmp_attr;
+        nattrs[p] = merge_attrs(ent, nrecords, attr);
+        fprintf(out, "\nstatic const struct msr_whitelist_record wl_%02X%02X[] = {\n", family, model);
+        for (i = 0; i < nrecords; ++i)
+        {
+            fprintf(out, "\t{ .msr = 0x%08X, .wmask = 0x%016llXULL", ent[i].rec.msr, (unsigned long long)ent[i].rec.wmask);
+            if (ent[i].rec.last)
+            {
+                fprintf(out, ", .last = 0x%08X", ent[i].rec.last);
+            }
+            fprintf(out, " },\n");
+        }
+        fprintf(out, "};\n");
+        if (nattrs[p])
+        {
+            fprintf(out, "\nstatic const struct msr_whitelist_attr wl_%02X%02X_attrs[] = {\n", family, model);
+        }
+        for (i = 0; i < nattrs[p]; ++i)
+        {
+            fprintf(out, "\t{ .msr = 0x%08X", attr[i].msr);
+            if (attr[i].last)
+            {
+                fprintf(out, ", .last = 0x%08X", attr[i].last);
+            }
+            if (attr[i].width)
+            {
+                fprintf(out, ", .width = %u", attr[i].width);
+            }
+            if (attr[i].scope)
+            {
+                fprintf(out, ", .scope = %u", attr[i].scope);
+            }
+            if (attr[i].op)
+            {
+                fprintf(out, ", .op = %u, .in = { 0x%08X, 0x%08X }", attr[i].op, attr[i].in[0], attr[i].in[1]);
+            }
+            if (attr[i].scale)
+            {
+                fprintf(out, ", .scale = %lluULL", (unsigned long long)attr[i].scale);
+            }
+            fprintf(out, " },\n");
+        }
+        if (nattrs[p])
+        {
+            fprintf(out, "};\n");
+        }
+        free(ent);
+        ent = NULL;
+    }
+    fprintf(out, "\nconst struct msr_whitelist_builtin msr_whitelist_builtins[] = {\n");
+    for (p = 0; p < npaths; ++p)
+    {
+        if (parse_model(paths[p], &family, &model))
+        {
+            continue;
+        }
+        if (nattrs[p])
+        {
+            fprintf(out, "\t{ 0x%02X, 0x%02X, ARRAY_SIZE(wl_%02X%02X), ARRAY_SIZE(wl_%02X%02X_attrs),\n"
+                         "\t  wl_%02X%02X, wl_%02X%02X_attrs },\n",
+                    family, model, family, model, family, model, family, model, family, model);
+        }
+        else
+        {
+            fprintf(out, "\t{ 0x%02X, 0x%02X, ARRAY_SIZE(wl_%02X%02X), 0, wl_%02X%02X, NULL },\n",
+                    family, model, family, model, family, model);
+        }
+    }
+    fprintf(out, "\t{ 0, 0, 0, 0, NULL, NULL }\n};\n");
+
+exit:
+    if (out && fclose(out) && !err)
+    {
+        err = errno ? errno : -1;
+        perror(out_path);
+    }
+    if (ent)
+    {
+        free(ent);
+    }
+    if (attr)
+    {
+        free(attr);
+    }
+    if (nattrs)
+    {
+        free(nattrs);
+    }
+    return err;
+}
+
+/* Print an image in the text whitelist syntax. */
+static int decompile(const char *in_path)
+{
+    int err = 0;
+    FILE *in = NULL;
+    struct msr_whitelist_header hdr;
+    struct msr_whitelist_record *rec = NULL;
+    struct msr_whitelist_attr *attr = NULL;
+    const struct msr_whitelist_attr **rec_attr = NULL;
+    struct msr_whitelist_attr none;
+    const struct msr_whitelist_attr *a = NULL;
+    uint32_t last;
+    uint32_t i;
+    uint32_t j;
+
+    in = fopen(in_path, "r");
+    if (!in)
+    {
+        err = errno ? errno : -1;
+        perror(in_path);
+        goto exit;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        hdr.magic != MSR_WHITELIST_MAGIC ||
+        hdr.version != MSR_WHITELIST_VERSION ||
+        hdr.nattrs > hdr.nrecords)
+    {
+        err = -1;
+        fprintf(stderr, "Error: %s: not a version %d whitelist image\n", in_path, MSR_WHITELIST_VERSION);
+        goto exit;
+    }
+    rec = (struct msr_whitelist_record *)malloc((hdr.nrecords + 1) * sizeof(*rec));
+    attr = (struct msr_whitelist_attr *)malloc((hdr.nattrs + 1) * sizeof(*attr));
+    rec_attr = (const struct msr_whitelist_attr **)calloc(hdr.nrecords + 1, sizeof(*rec_attr));
+    if (!rec || !attr || !rec_attr)
+    {
+        err = errno ? errno : -1;
+        perror("Unable to allocate records");
+        goto exit;
+    }
+    if (fread(rec, sizeof(*rec), hdr.nrecords, in) != hdr.nrecords ||
+        fread(attr, sizeof(*attr), hdr.nattrs, in) != hdr.nattrs)
+    {
+        err = -1;
+        fprintf(stderr, "Error: %s: truncated image\n", in_path);
+        goto exit;
+    }
+    /* Find the records each attribute covers as the module does */
+    for (i = 0, j = 0; j < hdr.nattrs; ++j)
+    {
+        last = attr[j].last ? attr[j].last : attr[j].msr;
+        while (i < hdr.nrecords && rec[i].msr < attr[j].msr)
+        {
+            ++i;
+        }
+        if (i == hdr.nrecords || rec[i].msr != attr[j].msr || last < attr[j].msr)
+        {
+            err = -1;
+            fprintf(stderr, "Error: %s: attribute for 0x%08X matches no record\n", in_path, attr[j].msr);
+            goto exit;
+        }
+        for (; i < hdr.nrecords && rec[i].msr <= last; ++i)
+        {
+            rec_attr[i] = &attr[j];
+        }
+    }
+    memset(&none, 0, sizeof(none));
+    for (i = 0; i < hdr.nrecords; ++i)
+    {
+        a = rec_attr[i] ? rec_attr[i] : &none;
+        printf("0x%08X", rec[i].msr);
+        if (rec[i].last)
+        {
+            printf("-0x%08X", rec[i].last);
+        }
+        printf("\t0x%016llX", (unsigned long long)rec[i].wmask);
+        if (a->width)
+        {
+            printf("\twidth=%u", a->width);
+        }
+        if (a->scope && a->scope <= MSR_WHITELIST_PACKAGE)
+        {
+            printf("\tscope=%s", scope_name[a->scope]);
+        }
+        switch (a->op)
+        {
+            case MSR_WHITELIST_DELTA:
+                printf("\tdelta=0x%X", a->in[0]);
+                break;
+            case MSR_WHITELIST_RATE:
+                printf("\trate=0x%X", a->in[0]);
+                break;
+            case MSR_WHITELIST_RATIO:
+                printf("\tratio=0x%X/0x%X", a->in[0], a->in[1]);
+                break;
+        }
+        if (a->scale)
+        {
+            printf("\tscale=%llu", (unsigned long long)a->scale);
+        }
+        printf("\n");
+    }
+
+exit:
+    if (in)
+    {
+        fclose(in);
+    }
+    if (rec_attr)
+    {
+        free(rec_attr);
+    }
+    if (attr)
+    {
+        free(attr);
+    }
+    if (rec)
+    {
+        free(rec);
+    }
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    const char *usage = "usage: msr_wlcompile whitelist image\n"
+                        "       msr_wlcompile -d image\n"
+                        "       msr_wlcompile -c source whitelist...\n";
+
+    if (argc == 3 && strcmp(argv[1], "-d") == 0)
+    {
+        return decompile(argv[2]);
+    }
+    if (argc >= 3 && strcmp(argv[1], "-c") == 0)
+    {
+        return builtin(argv[2], argc - 3, argv + 3);
+    }
+    if (argc == 3 && argv[1][0] != '-')
+    {
+        return compile(argv[1], argv[2]);
+    }
+    fprintf(stderr, "%s", usage);
+    return -1;
+}